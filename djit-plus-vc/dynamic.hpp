@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "fixed.hpp"
+
+// DynamicVectorClock is a vector clock whose size is decided at run time.
+// Entries past size() read as 0. Writing such an entry grows the clock,
+// doubling its capacity, so adding threads costs amortized O(1) per clock.
+// Up to kInlineSize entries are stored without heap allocation.
+class DynamicVectorClock {
+ public:
+  static constexpr size_t kInlineSize = 8;
+
+  DynamicVectorClock() = default;
+  DynamicVectorClock(const DynamicVectorClock& rhs) {
+    *this = rhs;
+  }
+  DynamicVectorClock(DynamicVectorClock&& rhs) noexcept {
+    *this = std::move(rhs);
+  }
+  ~DynamicVectorClock() {
+    if (!IsInline()) {
+      delete[] data_;
+    }
+  }
+
+  DynamicVectorClock& operator =(const DynamicVectorClock& rhs) {
+    if (this != &rhs) {
+      Reserve(rhs.size_);
+      std::copy_n(rhs.data_, rhs.size_, data_);
+      size_ = rhs.size_;
+    }
+    return *this;
+  }
+  DynamicVectorClock& operator =(DynamicVectorClock&& rhs) noexcept {
+    if (this == &rhs) {
+      return *this;
+    }
+    if (rhs.IsInline()) {
+      std::copy_n(rhs.data_, rhs.size_, data_);
+      size_ = rhs.size_;
+      return *this;
+    }
+    if (!IsInline()) {
+      delete[] data_;
+    }
+    data_ = std::exchange(rhs.data_, rhs.inline_);
+    size_ = std::exchange(rhs.size_, 0);
+    capacity_ = std::exchange(rhs.capacity_, kInlineSize);
+    return *this;
+  }
+
+  int operator [](size_t i) const {
+    return i < size_ ? data_[i] : 0;
+  }
+  int& operator [](size_t i) {
+    if (i >= size_) {
+      Resize(i + 1);
+    }
+    return data_[i];
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+  const int* data() const noexcept {
+    return data_;
+  }
+  int* data() noexcept {
+    return data_;
+  }
+
+  // Resize grows the clock to n entries, filling new entries with 0.
+  void Resize(size_t n) {
+    if (n <= size_) {
+      return;
+    }
+    Reserve(n);
+    std::fill(data_ + size_, data_ + n, 0);
+    size_ = n;
+  }
+
+ private:
+  bool IsInline() const noexcept {
+    return data_ == inline_;
+  }
+
+  void Reserve(size_t n) {
+    if (n <= capacity_) {
+      return;
+    }
+    const size_t cap = std::max<size_t>(n, 2 * capacity_);
+    int* p = new int[cap];
+    std::copy_n(data_, size_, p);
+    if (!IsInline()) {
+      delete[] data_;
+    }
+    data_ = p;
+    capacity_ = cap;
+  }
+
+  int* data_ = inline_;
+  uint32_t size_ = 0;
+  uint32_t capacity_ = kInlineSize;
+  int inline_[kInlineSize];
+};
+
+inline DynamicVectorClock& operator |=(DynamicVectorClock& lhs,
+                                       const DynamicVectorClock& rhs) {
+  lhs.Resize(rhs.size());
+  JoinClocks(lhs.data(), rhs.data(), rhs.size());
+  return lhs;
+}
+
+inline DynamicVectorClock operator |(const DynamicVectorClock& lhs,
+                                     const DynamicVectorClock& rhs) {
+  auto merged = lhs;
+  merged |= rhs;
+  return merged;
+}
+
+inline bool operator <=(const DynamicVectorClock& lhs,
+                        const DynamicVectorClock& rhs) {
+  const size_t n = std::min(lhs.size(), rhs.size());
+  if (!ClocksLessEq(lhs.data(), rhs.data(), n)) {
+    return false;
+  }
+  // Entries missing from rhs are 0.
+  return std::all_of(lhs.data() + n, lhs.data() + lhs.size(),
+                     [](int c) { return c <= 0; });
+}
+
+inline bool operator >(const DynamicVectorClock& lhs,
+                       const DynamicVectorClock& rhs) {
+  return !(lhs <= rhs);
+}
+
+inline bool operator <=(const Epoch& lhs, const DynamicVectorClock& rhs) {
+  return lhs.c <= rhs[lhs.t];
+}
+
+template <template <class> class Handler = FunctionHandler>
+using BasicDynamicAnalyzer = BasicAnalyzer<DynamicVectorClock, Handler>;
+using DynamicAnalyzer = BasicDynamicAnalyzer<>;
@@ -1,8 +1,28 @@
+#pragma once
+
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <map>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Clock kernels use AVX2 or SSE2 when the compiler targets them.
+// Define FIXED_VC_NO_SIMD to force the scalar implementation.
+#if !defined(FIXED_VC_NO_SIMD) && defined(__AVX2__)
+#define FIXED_VC_AVX2
+#include <immintrin.h>
+#elif !defined(FIXED_VC_NO_SIMD) && defined(__SSE2__)
+#define FIXED_VC_SSE2
+#include <emmintrin.h>
+#endif
+
 struct Variable {
   std::string name;
 };
@@ -19,6 +39,71 @@ bool operator <(const Lock& lhs, const Lock& rhs) {
   return lhs.name < rhs.name;
 }
 
+// VariableId and LockId are dense handles returned by Analyzer::Register.
+// They index flat arrays inside Analyzer, so accesses through them never
+// compare names.
+struct VariableId {
+  uint32_t index;
+};
+
+struct LockId {
+  uint32_t index;
+};
+
+// JoinClocks stores the elementwise maximum of dst and src into dst.
+inline void JoinClocks(int* dst, const int* src, size_t n) {
+  size_t i = 0;
+#if defined(FIXED_VC_AVX2)
+  for (; i < n / 8 * 8; i += 8) {
+    auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                        _mm256_max_epi32(d, s));
+  }
+#elif defined(FIXED_VC_SSE2)
+  // SSE2 has no pmaxsd, so select with a compare mask instead.
+  for (; i < n / 4 * 4; i += 4) {
+    auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    auto gt = _mm_cmpgt_epi32(s, d);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm_or_si128(_mm_and_si128(gt, s),
+                                  _mm_andnot_si128(gt, d)));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = std::max(dst[i], src[i]);
+  }
+}
+
+// ClocksLessEq returns true if lhs[i] <= rhs[i] for all i.
+// The comparison runs to the end without branching on each element.
+inline bool ClocksLessEq(const int* lhs, const int* rhs, size_t n) {
+  size_t i = 0;
+  int greater = 0;
+#if defined(FIXED_VC_AVX2)
+  auto acc = _mm256_setzero_si256();
+  for (; i < n / 8 * 8; i += 8) {
+    auto l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i));
+    auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i));
+    acc = _mm256_or_si256(acc, _mm256_cmpgt_epi32(l, r));
+  }
+  greater |= _mm256_movemask_epi8(acc);
+#elif defined(FIXED_VC_SSE2)
+  auto acc = _mm_setzero_si128();
+  for (; i < n / 4 * 4; i += 4) {
+    auto l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+    auto r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + i));
+    acc = _mm_or_si128(acc, _mm_cmpgt_epi32(l, r));
+  }
+  greater |= _mm_movemask_epi8(acc);
+#endif
+  for (; i < n; ++i) {
+    greater |= lhs[i] > rhs[i];
+  }
+  return greater == 0;
+}
+
 template <size_t N>
 struct FixedVectorClock {
   std::array<int, N> clocks{};
@@ -29,14 +114,16 @@ struct FixedVectorClock {
   int& operator [](size_t i) {
     return clocks[i];
   }
+
+  static constexpr size_t size() noexcept {
+    return N;
+  }
 };
 
 template <size_t N>
-FixedVectorClock<N> operator |=(FixedVectorClock<N>& lhs,
-                                const FixedVectorClock<N>& rhs) {
-  for (size_t i = 0; i < N; ++i) {
-    lhs[i] = std::max(lhs[i], rhs[i]);
-  }
+FixedVectorClock<N>& operator |=(FixedVectorClock<N>& lhs,
+                                 const FixedVectorClock<N>& rhs) {
+  JoinClocks(lhs.clocks.data(), rhs.clocks.data(), N);
   return lhs;
 }
 
@@ -51,12 +138,7 @@ FixedVectorClock<N> operator |(const FixedVectorClock<N>& lhs,
 template <size_t N>
 bool operator <=(const FixedVectorClock<N>& lhs,
                  const FixedVectorClock<N>& rhs) {
-  for (int i = 0; i < N; ++i) {
-    if (lhs[i] > rhs[i]) {
-      return false;
-    }
-  }
-  return true;
+  return ClocksLessEq(lhs.clocks.data(), rhs.clocks.data(), N);
 }
 
 template <size_t N>
@@ -65,95 +147,548 @@ bool operator >(const FixedVectorClock<N>& lhs,
   return !(lhs <= rhs);
 }
 
-template <size_t NThread>
-class Analyzer {
+// Epoch is a pair of a thread and its clock value, written as c@t.
+// The zero-initialized epoch 0@0 happens before every clock.
+struct Epoch {
+  int t;
+  int c;
+};
+
+inline bool operator ==(const Epoch& lhs, const Epoch& rhs) {
+  return lhs.t == rhs.t && lhs.c == rhs.c;
+}
+
+template <size_t N>
+bool operator <=(const Epoch& lhs, const FixedVectorClock<N>& rhs) {
+  return lhs.c <= rhs[lhs.t];
+}
+
+template <class Clock>
+Clock ToVectorClock(const Epoch& e) {
+  Clock vc{};
+  vc[e.t] = e.c;
+  return vc;
+}
+
+// kFixedThreads is the number of threads fixed by a clock type,
+// or 0 if the clock grows at run time.
+template <class Clock>
+inline constexpr size_t kFixedThreads = 0;
+
+template <size_t N>
+inline constexpr size_t kFixedThreads<FixedVectorClock<N>> = N;
+
+// Slab is a growable array whose storage starts on a cache line boundary.
+// T must be trivially copyable, so copying a slab is a single memcpy.
+template <class T>
+class Slab {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  static constexpr std::align_val_t kAlign{64};
+
+  Slab() = default;
+  Slab(const Slab& rhs) {
+    Reserve(rhs.size_);
+    if (rhs.size_ > 0) {
+      std::memcpy(data_, rhs.data_, rhs.size_ * sizeof(T));
+    }
+    size_ = rhs.size_;
+  }
+  Slab(Slab&& rhs) noexcept
+    : data_{std::exchange(rhs.data_, nullptr)},
+      size_{std::exchange(rhs.size_, 0)},
+      capacity_{std::exchange(rhs.capacity_, 0)} {
+  }
+  Slab& operator =(Slab rhs) noexcept {
+    std::swap(data_, rhs.data_);
+    std::swap(size_, rhs.size_);
+    std::swap(capacity_, rhs.capacity_);
+    return *this;
+  }
+  ~Slab() {
+    ::operator delete(data_, kAlign);
+  }
+
+  const T& operator [](size_t i) const {
+    return data_[i];
+  }
+  T& operator [](size_t i) {
+    return data_[i];
+  }
+  const T& at(size_t i) const {
+    if (i >= size_) {
+      throw std::out_of_range{"Slab::at"};
+    }
+    return data_[i];
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+
+  void push_back(const T& v) {
+    if (size_ == capacity_) {
+      Reserve(capacity_ == 0 ? 4 : 2 * capacity_);
+    }
+    new (data_ + size_) T(v);
+    ++size_;
+  }
+
+ private:
+  void Reserve(size_t n) {
+    if (n <= capacity_) {
+      return;
+    }
+    auto p = static_cast<T*>(::operator new(n * sizeof(T), kAlign));
+    if (size_ > 0) {
+      std::memcpy(p, data_, size_ * sizeof(T));
+    }
+    ::operator delete(data_, kAlign);
+    data_ = p;
+    capacity_ = n;
+  }
+
+  T* data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+// ClockArray is a Slab for trivially copyable clocks
+// and a std::vector for clocks that own heap memory.
+template <class Clock>
+using ClockArray = std::conditional_t<std::is_trivially_copyable_v<Clock>,
+                                      Slab<Clock>, std::vector<Clock>>;
+
+// AccessHistory keeps the access history of variables indexed by a dense
+// index. The last write of a variable is always an epoch. Reads stay an
+// epoch while they are totally ordered, and are inflated to a vector clock
+// only when two reads are concurrent (FastTrack).
+template <class Clock>
+class AccessHistory {
  public:
-  Analyzer() : thread_vc_{}, read_vc_{}, write_vc_{}, lock_vc_{} {
-    for (int i = 0; i < NThread; ++i) {
-      thread_vc_[i][i] = 1;
+  static constexpr int kNoRace = -1;
+
+  size_t size() const noexcept {
+    return write_epoch_.size();
+  }
+  // Resize grows the history to hold n variables.
+  void Resize(size_t n) {
+    while (write_epoch_.size() < n) {
+      write_epoch_.push_back(Epoch{});
+      read_epoch_.push_back(Epoch{});
+      read_slot_.push_back(kNoSlot);
     }
   }
 
-  Analyzer& Read(int t, const Variable& x) {
-    read_vc_[x][t] = thread_vc_[t][t];
-    if (write_vc_[x] > thread_vc_[t]) {
-      if (on_read_violated_) {
-        on_read_violated_(*this, t, x);
+  // Read records a read of variable i by thread t, whose clock is ct.
+  // It returns a thread whose write races with the read, or kNoRace.
+  int Read(size_t i, int t, const Clock& ct) {
+    auto& r = read_epoch_[i];
+    const Epoch e{t, ct[t]};
+    const bool shared = r.t == kSharedRead;
+    if (shared ? read_vc_[read_slot_[i]][t] == e.c : r == e) {
+      return kNoRace;
+    }
+
+    const auto& w = write_epoch_[i];
+    const int other = w <= ct ? kNoRace : w.t;
+
+    if (shared) {
+      read_vc_[read_slot_[i]][t] = e.c;
+    } else if (r <= ct) {
+      r = e;
+    } else {
+      auto& rvc = read_vc_[SharedReadSlot(i)];
+      rvc = ToVectorClock<Clock>(r);
+      rvc[t] = e.c;
+      r.t = kSharedRead;
+    }
+    return other;
+  }
+
+  // Write records a write of variable i by thread t, whose clock is ct.
+  // It returns a thread whose access races with the write, or kNoRace.
+  int Write(size_t i, int t, const Clock& ct) {
+    auto& w = write_epoch_[i];
+    auto& r = read_epoch_[i];
+    const Epoch e{t, ct[t]};
+    if (w == e) {
+      return kNoRace;
+    }
+
+    const bool shared = r.t == kSharedRead;
+    int other = kNoRace;
+    if (!(w <= ct)) {
+      other = w.t;
+    } else if (!shared && !(r <= ct)) {
+      other = r.t;
+    } else if (shared && !(read_vc_[read_slot_[i]] <= ct)) {
+      other = FirstUncovered(read_vc_[read_slot_[i]], ct);
+    }
+
+    w = e;
+    if (shared) {
+      r = Epoch{};
+    }
+    return other;
+  }
+
+  Clock ReadVC(size_t i) const {
+    const auto& r = read_epoch_.at(i);
+    return r.t == kSharedRead ? read_vc_[read_slot_[i]]
+                              : ToVectorClock<Clock>(r);
+  }
+  Clock WriteVC(size_t i) const {
+    return ToVectorClock<Clock>(write_epoch_.at(i));
+  }
+
+ private:
+  // Epoch::t of a read epoch whose reads have been inflated into read_vc_.
+  static constexpr int kSharedRead = -1;
+  static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+  // FirstUncovered returns the first thread whose entry in vc
+  // is greater than in ct.
+  static int FirstUncovered(const Clock& vc, const Clock& ct) {
+    for (size_t i = 0; i < vc.size(); ++i) {
+      if (vc[i] > ct[i]) {
+        return i;
       }
     }
+    return kNoRace;
+  }
+
+  // SharedReadSlot returns the index of the read vector clock of
+  // variable i, allocating one on the first inflation. A slot is kept for
+  // the variable once allocated and reused when its reads become
+  // concurrent again.
+  uint32_t SharedReadSlot(size_t i) {
+    auto& slot = read_slot_[i];
+    if (slot == kNoSlot) {
+      slot = read_vc_.size();
+      read_vc_.push_back(Clock{});
+    }
+    return slot;
+  }
+
+  // All clocks live in cache-line aligned slabs indexed by variable.
+  // Copying a history snapshots each slab with one memcpy.
+  // Clocks owning heap memory are kept in vectors instead.
+  Slab<Epoch> write_epoch_, read_epoch_;
+  Slab<uint32_t> read_slot_;
+  ClockArray<Clock> read_vc_;
+};
+
+// A violation handler policy is a class template instantiated with the
+// analyzer type. It has two member functions called on every race:
+//
+//   void OnReadViolation(const Analyzer& a, int t, VariableId x, int other);
+//   void OnWriteViolation(const Analyzer& a, int t, VariableId x, int other);
+//
+// other is a thread whose access to x is concurrent with this one.
+// The calls are resolved at compile time, so they can be inlined, and
+// a handler doing nothing costs nothing.
+
+// FunctionHandler calls std::function objects set at run time.
+template <class Analyzer>
+class FunctionHandler {
+ public:
+  using ViolationHandler = std::function<
+    void (const Analyzer&, int t, const Variable&)
+  >;
+
+  void SetReadViolationHandler(const ViolationHandler& f) {
+    on_read_violated_ = f;
+  }
+  void SetWriteViolationHandler(const ViolationHandler& f) {
+    on_write_violated_ = f;
+  }
+
+  void OnReadViolation(const Analyzer& a, int t, VariableId x, int) {
+    if (on_read_violated_) {
+      on_read_violated_(a, t, a.GetVariable(x));
+    }
+  }
+  void OnWriteViolation(const Analyzer& a, int t, VariableId x, int) {
+    if (on_write_violated_) {
+      on_write_violated_(a, t, a.GetVariable(x));
+    }
+  }
+
+ private:
+  ViolationHandler on_read_violated_, on_write_violated_;
+};
+
+// NullHandler ignores races.
+template <class Analyzer>
+struct NullHandler {
+  void OnReadViolation(const Analyzer&, int, VariableId, int) {}
+  void OnWriteViolation(const Analyzer&, int, VariableId, int) {}
+};
+
+enum class ViolationKind : uint8_t {
+  kRead,
+  kWrite,
+};
+
+// ViolationRecord is a race reported by ReportBuffer.
+struct ViolationRecord {
+  uint64_t event;  // index of the racing event, counted from 0
+  uint32_t t;      // thread of the racing event
+  uint32_t x;      // index of the VariableId
+  uint32_t other;  // thread of a concurrent earlier access
+  ViolationKind kind;
+};
+
+// ReportBuffer appends races to a vector instead of handling them one by
+// one. Callers drain the records in batches, for example after every N
+// events, keeping the detection loop free of callbacks.
+template <class Analyzer>
+class ReportBuffer {
+ public:
+  void Reserve(size_t n) {
+    records_.reserve(n);
+  }
+
+  void OnReadViolation(const Analyzer& a, int t, VariableId x, int other) {
+    Append(a, t, x, other, ViolationKind::kRead);
+  }
+  void OnWriteViolation(const Analyzer& a, int t, VariableId x, int other) {
+    Append(a, t, x, other, ViolationKind::kWrite);
+  }
+
+  const std::vector<ViolationRecord>& Records() const {
+    return records_;
+  }
+
+  // Drain passes the buffered records to f, which may modify them,
+  // and clears the buffer keeping its capacity.
+  template <class F>
+  void Drain(F f) {
+    f(records_);
+    records_.clear();
+  }
+
+ private:
+  void Append(const Analyzer& a, int t, VariableId x, int other,
+              ViolationKind kind) {
+    records_.push_back(ViolationRecord{
+      a.NumEvents() - 1, static_cast<uint32_t>(t), x.index,
+      static_cast<uint32_t>(other), kind
+    });
+  }
+
+  std::vector<ViolationRecord> records_;
+};
+
+// Deduplicate removes records of the same kind, thread, variable and
+// conflicting thread, keeping the earliest one. counts receives how many
+// records each remaining one stands for.
+inline void Deduplicate(std::vector<ViolationRecord>& records,
+                        std::vector<uint64_t>& counts) {
+  auto key = [](const ViolationRecord& r) {
+    return std::make_tuple(r.x, r.kind, r.t, r.other, r.event);
+  };
+  std::sort(records.begin(), records.end(),
+            [&](const auto& a, const auto& b) { return key(a) < key(b); });
+
+  auto same = [](const ViolationRecord& a, const ViolationRecord& b) {
+    return a.x == b.x && a.kind == b.kind && a.t == b.t && a.other == b.other;
+  };
+  counts.clear();
+  size_t n = 0;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (n > 0 && same(records[n - 1], records[i])) {
+      ++counts.back();
+    } else {
+      records[n++] = records[i];
+      counts.push_back(1);
+    }
+  }
+  records.resize(n);
+}
+
+// BasicAnalyzer checks data races with clocks of type Clock and reports
+// them to a Handler<BasicAnalyzer>.
+// FixedVectorClock fixes the number of threads at compile time while
+// DynamicVectorClock (dynamic.hpp) lets threads be added with AddThread.
+// With a fixed clock, the constructor throws std::invalid_argument if
+// num_threads exceeds the number of threads of the clock.
+template <class Clock, template <class> class Handler = FunctionHandler>
+class BasicAnalyzer {
+ public:
+  explicit BasicAnalyzer(size_t num_threads = kFixedThreads<Clock>,
+                         Handler<BasicAnalyzer> handler = {})
+    : handler_{std::move(handler)} {
+    if (kFixedThreads<Clock> != 0 && num_threads > kFixedThreads<Clock>) {
+      throw std::invalid_argument{
+          "BasicAnalyzer: more threads than the clock type holds"};
+    }
+    for (size_t i = 0; i < num_threads; ++i) {
+      NewThread();
+    }
+  }
+
+  // AddThread starts a new thread and returns its ID.
+  // Other clocks are not touched; they grow when the new thread's
+  // entry is first written.
+  int AddThread() {
+    static_assert(kFixedThreads<Clock> == 0,
+                  "the clock type has a fixed number of threads");
+    return NewThread();
+  }
+  size_t NumThreads() const {
+    return thread_vc_.size();
+  }
+  // NumEvents returns the number of Read, Write, Acquire and Release
+  // calls so far, including the one being processed.
+  uint64_t NumEvents() const {
+    return num_events_;
+  }
+
+  BasicAnalyzer& Read(int t, VariableId x) {
+    ++num_events_;
+    const int other = history_.Read(x.index, t, thread_vc_[t]);
+    if (other != AccessHistory<Clock>::kNoRace) {
+      handler_.OnReadViolation(*this, t, x, other);
+    }
     return *this;
   }
-  Analyzer& Write(int t, const Variable& x) {
-    write_vc_[x][t] = thread_vc_[t][t];
-    if (write_vc_[x] > thread_vc_[t] || read_vc_[x] > thread_vc_[t]) {
-      if (on_write_violated_) {
-        on_write_violated_(*this, t, x);
-      }
+  BasicAnalyzer& Write(int t, VariableId x) {
+    ++num_events_;
+    const int other = history_.Write(x.index, t, thread_vc_[t]);
+    if (other != AccessHistory<Clock>::kNoRace) {
+      handler_.OnWriteViolation(*this, t, x, other);
     }
     return *this;
   }
-  Analyzer& Acquire(int t, const Lock& m) {
-    thread_vc_[t] |= lock_vc_[m];
+  BasicAnalyzer& Acquire(int t, LockId m) {
+    ++num_events_;
+    thread_vc_[t] |= lock_vc_[m.index];
     return *this;
   }
-  Analyzer& Release(int t, const Lock& m) {
+  // Release publishes the clock of t to m and then starts a new epoch of t,
+  // as in FastTrack. Accesses of t after the release are in an epoch no
+  // other thread has seen, which the same-epoch checks of AccessHistory
+  // rely on.
+  BasicAnalyzer& Release(int t, LockId m) {
+    ++num_events_;
+    lock_vc_[m.index] = thread_vc_[t];
     ++thread_vc_[t][t];
-    lock_vc_[m] = thread_vc_[t];
     return *this;
   }
 
-  Analyzer& Register(const Variable& x) {
-    variables_.push_back(x);
-    read_vc_.emplace(x, FixedVectorClock<NThread>{});
-    write_vc_.emplace(x, FixedVectorClock<NThread>{});
-    return *this;
+  BasicAnalyzer& Read(int t, const Variable& x) {
+    return Read(t, Register(x));
   }
-  Analyzer& Register(const Lock& m) {
-    locks_.push_back(m);
-    lock_vc_.emplace(m, FixedVectorClock<NThread>{});
-    return *this;
+  BasicAnalyzer& Write(int t, const Variable& x) {
+    return Write(t, Register(x));
+  }
+  BasicAnalyzer& Acquire(int t, const Lock& m) {
+    return Acquire(t, Register(m));
+  }
+  BasicAnalyzer& Release(int t, const Lock& m) {
+    return Release(t, Register(m));
+  }
+
+  // Register returns the handle of x, allocating a new one
+  // if x has not been registered yet.
+  VariableId Register(const Variable& x) {
+    auto [it, inserted] = variable_ids_.emplace(
+        x, VariableId{static_cast<uint32_t>(variables_.size())});
+    if (inserted) {
+      variables_.push_back(x);
+      history_.Resize(variables_.size());
+    }
+    return it->second;
+  }
+  LockId Register(const Lock& m) {
+    auto [it, inserted] = lock_ids_.emplace(
+        m, LockId{static_cast<uint32_t>(locks_.size())});
+    if (inserted) {
+      locks_.push_back(m);
+      lock_vc_.push_back(Clock{});
+    }
+    return it->second;
   }
 
-  const std::vector<Variable> GetVariables() const {
+  const std::vector<Variable>& GetVariables() const {
     return variables_;
   }
-  const std::vector<Lock> GetLocks() const {
+  const std::vector<Lock>& GetLocks() const {
     return locks_;
   }
+  const Variable& GetVariable(VariableId x) const {
+    return variables_.at(x.index);
+  }
+  const Lock& GetLock(LockId m) const {
+    return locks_.at(m.index);
+  }
 
-  const FixedVectorClock<NThread>& GetThreadVC(int t) const {
+  const Clock& GetThreadVC(int t) const {
     return thread_vc_.at(t);
   }
-  const FixedVectorClock<NThread>& GetReadVC(const Variable& x) const {
-    return read_vc_.at(x);
+  Clock GetReadVC(VariableId x) const {
+    return history_.ReadVC(x.index);
+  }
+  Clock GetWriteVC(VariableId x) const {
+    return history_.WriteVC(x.index);
+  }
+  const Clock& GetLockVC(LockId m) const {
+    return lock_vc_.at(m.index);
+  }
+  Clock GetReadVC(const Variable& x) const {
+    return GetReadVC(variable_ids_.at(x));
   }
-  const FixedVectorClock<NThread>& GetWriteVC(const Variable& x) const {
-    return write_vc_.at(x);
+  Clock GetWriteVC(const Variable& x) const {
+    return GetWriteVC(variable_ids_.at(x));
   }
-  const FixedVectorClock<NThread>& GetLockVC(const Lock& m) const {
-    return lock_vc_.at(m);
+  const Clock& GetLockVC(const Lock& m) const {
+    return GetLockVC(lock_ids_.at(m));
   }
 
-  using ViolationHandler = std::function<
-    void (const Analyzer<NThread>&, int t, const Variable&)
-  >;
+  const Handler<BasicAnalyzer>& GetHandler() const {
+    return handler_;
+  }
+  Handler<BasicAnalyzer>& GetHandler() {
+    return handler_;
+  }
 
-  Analyzer& SetReadViolationHandler(const ViolationHandler& f) {
-    on_read_violated_ = f;
+  // The setters are available with FunctionHandler.
+  template <class F>
+  BasicAnalyzer& SetReadViolationHandler(const F& f) {
+    handler_.SetReadViolationHandler(f);
     return *this;
   }
-  Analyzer& SetWriteViolationHandler(const ViolationHandler& f) {
-    on_write_violated_ = f;
+  template <class F>
+  BasicAnalyzer& SetWriteViolationHandler(const F& f) {
+    handler_.SetWriteViolationHandler(f);
     return *this;
   }
 
  private:
-  std::array<FixedVectorClock<NThread>, NThread> thread_vc_;
-  std::map<Variable, FixedVectorClock<NThread>> read_vc_, write_vc_;
-  std::map<Lock, FixedVectorClock<NThread>> lock_vc_;
+  int NewThread() {
+    const int t = thread_vc_.size();
+    thread_vc_.push_back(Clock{});
+    thread_vc_[t][t] = 1;
+    return t;
+  }
+
+  // Clocks live in cache-line aligned slabs indexed by thread or lock ID.
+  // Copying an Analyzer snapshots each slab with one memcpy.
+  ClockArray<Clock> thread_vc_;
+  ClockArray<Clock> lock_vc_;
+  AccessHistory<Clock> history_;
 
   std::vector<Variable> variables_;
   std::vector<Lock> locks_;
+  std::map<Variable, VariableId> variable_ids_;
+  std::map<Lock, LockId> lock_ids_;
 
-  ViolationHandler on_read_violated_, on_write_violated_;
+  uint64_t num_events_ = 0;
+  [[no_unique_address]] Handler<BasicAnalyzer> handler_;
 };
+
+template <size_t NThread, template <class> class Handler = FunctionHandler>
+using Analyzer = BasicAnalyzer<FixedVectorClock<NThread>, Handler>;
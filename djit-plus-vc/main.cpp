@@ -1,96 +1,263 @@
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <string_view>
 
+#include "dynamic.hpp"
 #include "fixed.hpp"
+#include "sharded.hpp"
+#include "trace.hpp"
 
-template <size_t NThread>
-void PrintHeader(const Analyzer<NThread>& a) {
-  std::cout << "C0";
-  for (int t = 1; t < NThread; ++t) {
-    std::cout << "\tC" << t;
+/*
+ * BufferedWriter formats output into a reusable buffer
+ * and writes it to stdout in large blocks.
+ */
+class BufferedWriter {
+ public:
+  ~BufferedWriter() {
+    Flush();
   }
-  for (const Variable& x : a.GetVariables()) {
-    std::cout << "\tR" << x.name << "\tW" << x.name;
+
+  BufferedWriter& operator <<(std::string_view s) {
+    buf_ += s;
+    return *this;
   }
-  for (const Lock& m : a.GetLocks()) {
-    std::cout << "\tL" << m.name;
+  BufferedWriter& operator <<(char c) {
+    buf_ += c;
+    return *this;
+  }
+  BufferedWriter& operator <<(long v) {
+    char num[24];
+    auto [end, ec] = std::to_chars(num, num + sizeof(num), v);
+    buf_.append(num, end);
+    return *this;
   }
-  std::cout << std::endl;
-}
 
-template <size_t N>
-void PrintVC(const FixedVectorClock<N>& vc) {
-  std::cout << "<" << vc[0];
-  for (int i = 1; i < N; ++i) {
-    std::cout << "," << vc[i];
+  // EndLine ends a line and flushes the buffer once it is large enough.
+  void EndLine() {
+    buf_ += '\n';
+    if (buf_.size() >= kFlushSize) {
+      Flush();
+    }
   }
-  std::cout << ">";
-}
 
-template <size_t NThread>
-void PrintVCs(const Analyzer<NThread>& a) {
-  PrintVC(a.GetThreadVC(0));
-  for (int t = 1; t < NThread; ++t) {
-    std::cout << "\t";
-    PrintVC(a.GetThreadVC(t));
+  void Flush() {
+    std::fwrite(buf_.data(), 1, buf_.size(), stdout);
+    std::fflush(stdout);
+    buf_.clear();
   }
-  for (const Variable& x : a.GetVariables()) {
-    std::cout << "\t";
-    PrintVC(a.GetReadVC(x));
-    std::cout << "\t";
-    PrintVC(a.GetWriteVC(x));
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 16;
+
+  std::string buf_;
+};
+
+// DumpMode decides when the state of the analyzer is printed.
+enum class DumpMode {
+  kOff,        // print only detected races
+  kViolation,  // print events detected as races and the state after them
+  kEveryN,     // print every Nth event and the state after it
+  kFull,       // print every event and the state after it
+};
+
+struct DumpPolicy {
+  DumpMode mode;
+  long interval;
+};
+
+/*
+ * StateDumper prints events and clocks of an analyzer
+ * as selected by a DumpPolicy.
+ */
+template <class Clock>
+class StateDumper {
+ public:
+  StateDumper(const BasicAnalyzer<Clock>& a, BufferedWriter& w,
+              DumpPolicy policy)
+    : a_{a}, w_{w}, policy_{policy} {
   }
-  for (const Lock& m : a.GetLocks()) {
-    std::cout << "\t";
-    PrintVC(a.GetLockVC(m));
+
+  // Begin prints the column names and the initial state.
+  void Begin() {
+    if (policy_.mode == DumpMode::kOff) {
+      return;
+    }
+    PrintHeader();
+    PrintVCs();
   }
-  std::cout << std::endl;
-}
 
-const int kNumThread = 2;
+  // BeginEvent starts an event and prints it if the policy selects it.
+  void BeginEvent(const char* op, int t, std::string_view name) {
+    op_ = op;
+    t_ = t;
+    name_ = name;
+    printed_ = policy_.mode == DumpMode::kFull ||
+      (policy_.mode == DumpMode::kEveryN &&
+       num_events_ % policy_.interval == 0);
+    if (printed_) {
+      PrintEvent();
+    }
+  }
 
-//#define PROTECT_BY_LOCK
+  // Violated reports that the current event is a race.
+  void Violated() {
+    if (!printed_ && policy_.mode == DumpMode::kViolation) {
+      PrintEvent();
+      printed_ = true;
+    }
+    w_ << "data race is detected: " << op_ << '(' << long{t_} << ','
+       << name_ << ')';
+    w_.EndLine();
+  }
 
-int main() {
-  Analyzer<kNumThread> a;
+  // EndEvent prints the state after the event if the event was printed.
+  void EndEvent() {
+    ++num_events_;
+    if (printed_) {
+      PrintVCs();
+    }
+  }
+
+ private:
+  void PrintHeader() {
+    w_ << "C0";
+    for (size_t t = 1; t < a_.NumThreads(); ++t) {
+      w_ << "\tC" << static_cast<long>(t);
+    }
+    for (const Variable& x : a_.GetVariables()) {
+      w_ << "\tR" << x.name << "\tW" << x.name;
+    }
+    for (const Lock& m : a_.GetLocks()) {
+      w_ << "\tL" << m.name;
+    }
+    w_.EndLine();
+  }
+
+  void PrintEvent() {
+    w_ << op_ << '(' << long{t_} << ',' << name_ << ')';
+    w_.EndLine();
+  }
+
+  void PrintVC(const Clock& vc) {
+    w_ << '<' << long{vc[0]};
+    for (size_t i = 1; i < a_.NumThreads(); ++i) {
+      w_ << ',' << long{vc[i]};
+    }
+    w_ << '>';
+  }
+
+  void PrintVCs() {
+    PrintVC(a_.GetThreadVC(0));
+    for (size_t t = 1; t < a_.NumThreads(); ++t) {
+      w_ << '\t';
+      PrintVC(a_.GetThreadVC(t));
+    }
+    for (uint32_t i = 0; i < a_.GetVariables().size(); ++i) {
+      w_ << '\t';
+      PrintVC(a_.GetReadVC(VariableId{i}));
+      w_ << '\t';
+      PrintVC(a_.GetWriteVC(VariableId{i}));
+    }
+    for (uint32_t i = 0; i < a_.GetLocks().size(); ++i) {
+      w_ << '\t';
+      PrintVC(a_.GetLockVC(LockId{i}));
+    }
+    w_.EndLine();
+  }
+
+  const BasicAnalyzer<Clock>& a_;
+  BufferedWriter& w_;
+  DumpPolicy policy_;
+  long num_events_ = 0;
+
+  const char* op_ = "";
+  int t_ = 0;
+  std::string_view name_;
+  bool printed_ = false;
+};
+
+template <class Clock>
+void SetViolationHandlers(BasicAnalyzer<Clock>& a,
+                          StateDumper<Clock>& dumper) {
   a.SetReadViolationHandler(
-    [](const auto& an, int t, const auto& x) {
-      std::cout << "data race is detected: rd("
-                << t << "," << x.name << ")" << std::endl;
+    [&dumper](const auto&, int, const auto&) {
+      dumper.Violated();
     });
   a.SetWriteViolationHandler(
-    [](const auto& an, int t, const auto& x) {
-      std::cout << "data race is detected: wr("
-                << t << "," << x.name << ")" << std::endl;
+    [&dumper](const auto&, int, const auto&) {
+      dumper.Violated();
     });
+}
 
-  Variable x{"x"};
-  Lock m{"m"};
-  a.Register(x);
-  a.Register(m);
+const int kNumThread = 2;
+
+//#define PROTECT_BY_LOCK
+//#define WRITE_AFTER_RELEASE
+
+/*
+ * RunModel runs the model written in this file.
+ * Events are also written to recorder unless it is null.
+ */
+void RunModel(TraceWriter* recorder, DumpPolicy policy) {
+  Analyzer<kNumThread> a;
+  BufferedWriter w;
+  StateDumper dumper{a, w, policy};
+  SetViolationHandlers(a, dumper);
+
+  const VariableId x = a.Register(Variable{"x"});
+  // Every model registers m so that the output has the same columns.
+  a.Register(Lock{"m"});
+
+  if (recorder) {
+    TraceHeader h{kNumThread, {}, {}};
+    for (const Variable& x : a.GetVariables()) {
+      h.variables.push_back(x.name);
+    }
+    for (const Lock& m : a.GetLocks()) {
+      h.locks.push_back(m.name);
+    }
+    recorder->WriteHeader(h);
+  }
+  auto record = [&](int t, TraceOp op, uint32_t object) {
+    if (recorder) {
+      recorder->Append(TraceEvent{static_cast<uint32_t>(t), op, object});
+    }
+  };
 
-  auto rd = [&](int t, const Variable& x) {
-    std::cout << "rd(" << t << "," << x.name << ")" << std::endl;
+  auto rd = [&](int t, VariableId x) {
+    record(t, TraceOp::kRead, x.index);
+    dumper.BeginEvent("rd", t, a.GetVariable(x).name);
     a.Read(t, x);
-    PrintVCs(a);
+    dumper.EndEvent();
   };
-  auto wr = [&](int t, const Variable& x) {
-    std::cout << "wr(" << t << "," << x.name << ")" << std::endl;
+  auto wr = [&](int t, VariableId x) {
+    record(t, TraceOp::kWrite, x.index);
+    dumper.BeginEvent("wr", t, a.GetVariable(x).name);
     a.Write(t, x);
-    PrintVCs(a);
+    dumper.EndEvent();
   };
-  auto acq = [&](int t, const Lock& m) {
-    std::cout << "acq(" << t << "," << m.name << ")" << std::endl;
+
+  dumper.Begin();
+
+#if defined(PROTECT_BY_LOCK) || defined(WRITE_AFTER_RELEASE)
+  const LockId m = a.Register(Lock{"m"});
+  auto acq = [&](int t, LockId m) {
+    record(t, TraceOp::kAcquire, m.index);
+    dumper.BeginEvent("acq", t, a.GetLock(m).name);
     a.Acquire(t, m);
-    PrintVCs(a);
+    dumper.EndEvent();
   };
-  auto rel = [&](int t, const Lock& m) {
-    std::cout << "rel(" << t << "," << m.name << ")" << std::endl;
+  auto rel = [&](int t, LockId m) {
+    record(t, TraceOp::kRelease, m.index);
+    dumper.BeginEvent("rel", t, a.GetLock(m).name);
     a.Release(t, m);
-    PrintVCs(a);
+    dumper.EndEvent();
   };
-
-  PrintHeader(a);
-  PrintVCs(a);
+#endif
 
 #ifdef PROTECT_BY_LOCK
   acq(0, m);
@@ -101,6 +268,16 @@ int main() {
   rd(1, x);
   wr(1, x);
   rel(1, m);
+#elif defined(WRITE_AFTER_RELEASE)
+  // Thread 0 writes x after releasing m, so the read by thread 1 races
+  // with the write. If the release published the epoch thread 0 goes on
+  // writing in, the write would look ordered before the read and the
+  // second write would be skipped as the same epoch: no race at all.
+  rel(0, m);
+  acq(1, m);
+  wr(0, x);
+  rd(1, x);
+  wr(0, x);
 #else
   rd(0, x);
   rd(1, x);
@@ -108,3 +285,286 @@ int main() {
   wr(1, x);
 #endif
 }
+
+/*
+ * RegisterNames registers the variables and locks of a trace in order,
+ * so that indices in the trace equal the handles of the analyzer.
+ * Returns true on failure.
+ */
+template <class A>
+bool RegisterNames(A& a, const TraceHeader& h) {
+  for (size_t i = 0; i < h.variables.size(); ++i) {
+    if (a.Register(Variable{h.variables[i]}).index != i) {
+      std::cerr << "Duplicate variable '" << h.variables[i] << "'" << std::endl;
+      return true;
+    }
+  }
+  for (size_t i = 0; i < h.locks.size(); ++i) {
+    if (a.Register(Lock{h.locks[i]}).index != i) {
+      std::cerr << "Duplicate lock '" << h.locks[i] << "'" << std::endl;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * ReplayEvents decodes events one at a time and applies them to a.
+ * observer.BeginEvent() and observer.EndEvent() are called around
+ * every event. Returns true on failure.
+ */
+template <class A, class Observer>
+bool ReplayEvents(TraceReader& reader, const TraceHeader& h,
+                  A& a, Observer& observer) {
+  const size_t num_vars = h.variables.size();
+  const size_t num_locks = h.locks.size();
+  uint64_t n = 0;
+  for (TraceEvent ev; reader.Next(ev); ++n) {
+    const bool is_var = ev.op == TraceOp::kRead || ev.op == TraceOp::kWrite;
+    if (ev.t >= h.num_threads ||
+        ev.object >= (is_var ? num_vars : num_locks)) {
+      std::cerr << "Invalid event #" << n << std::endl;
+      return true;
+    }
+
+    switch (ev.op) {
+    case TraceOp::kRead:
+      observer.BeginEvent("rd", ev.t, h.variables[ev.object]);
+      a.Read(ev.t, VariableId{ev.object});
+      break;
+    case TraceOp::kWrite:
+      observer.BeginEvent("wr", ev.t, h.variables[ev.object]);
+      a.Write(ev.t, VariableId{ev.object});
+      break;
+    case TraceOp::kAcquire:
+      observer.BeginEvent("acq", ev.t, h.locks[ev.object]);
+      a.Acquire(ev.t, LockId{ev.object});
+      break;
+    case TraceOp::kRelease:
+      observer.BeginEvent("rel", ev.t, h.locks[ev.object]);
+      a.Release(ev.t, LockId{ev.object});
+      break;
+    default:
+      std::cerr << "Unknown op in event #" << n << std::endl;
+      return true;
+    }
+    observer.EndEvent();
+  }
+  if (reader.Failed()) {
+    std::cerr << "Truncated trace after event #" << n << std::endl;
+    return true;
+  }
+
+  std::cerr << "replayed " << n << " events" << std::endl;
+  return false;
+}
+
+// NoDump is an observer for ReplayEvents printing nothing.
+struct NoDump {
+  void BeginEvent(const char*, int, std::string_view) {}
+  void EndEvent() {}
+};
+
+/*
+ * PrintRecords prints each distinct race in records once.
+ */
+void PrintRecords(BufferedWriter& w, const TraceHeader& h,
+                  std::vector<ViolationRecord>& records,
+                  std::vector<uint64_t>& counts) {
+  Deduplicate(records, counts);
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto& r = records[i];
+    const bool rd = r.kind == ViolationKind::kRead;
+    w << "data race is detected: " << (rd ? "rd(" : "wr(")
+      << long{r.t} << ',' << h.variables[r.x] << ')'
+      << " with thread " << long{r.other}
+      << " at event #" << static_cast<long>(r.event)
+      << " (" << static_cast<long>(counts[i]) << " times)";
+    w.EndLine();
+  }
+}
+
+/*
+ * BatchReporter drains the races buffered by ReportBuffer every
+ * kBatchSize events and prints each distinct race once per batch.
+ */
+template <class A>
+class BatchReporter {
+ public:
+  static constexpr uint64_t kBatchSize = 1 << 20;
+
+  BatchReporter(A& a, BufferedWriter& w, const TraceHeader& h)
+    : a_{a}, w_{w}, h_{h} {
+    a_.GetHandler().Reserve(kBatchSize);
+  }
+
+  void BeginEvent(const char*, int, std::string_view) {
+  }
+  void EndEvent() {
+    if (++num_events_ % kBatchSize == 0) {
+      Drain();
+    }
+  }
+
+  void Drain() {
+    a_.GetHandler().Drain([this](std::vector<ViolationRecord>& records) {
+      PrintRecords(w_, h_, records, counts_);
+    });
+  }
+
+ private:
+  A& a_;
+  BufferedWriter& w_;
+  const TraceHeader& h_;
+  uint64_t num_events_ = 0;
+  std::vector<uint64_t> counts_;
+};
+
+/*
+ * Replay streams the events of a trace file into DynamicAnalyzer.
+ * The file is memory-mapped and events are decoded one at a time.
+ * With batch set, races are buffered and reported in batches.
+ * With num_workers > 0, variables are checked in parallel by
+ * ShardedAnalyzer and races are reported at the end.
+ * Returns true on failure.
+ */
+bool Replay(const char* path, DumpPolicy policy, bool batch,
+            size_t num_workers) {
+  MappedFile file;
+  if (file.Open(path)) {
+    return true;
+  }
+
+  TraceReader reader{file.begin(), file.end()};
+  TraceHeader h;
+  if (reader.ReadHeader(h)) {
+    return true;
+  }
+
+  BufferedWriter w;
+  if (num_workers > 0) {
+    ShardedAnalyzer<DynamicVectorClock> a{h.num_threads, num_workers};
+    NoDump observer;
+    if (ReplayEvents(reader, h, a, observer)) {
+      return true;
+    }
+    auto records = a.Finish();
+    std::vector<uint64_t> counts;
+    PrintRecords(w, h, records, counts);
+    return false;
+  }
+
+  if (batch) {
+    BasicDynamicAnalyzer<ReportBuffer> a{h.num_threads};
+    BatchReporter reporter{a, w, h};
+    if (RegisterNames(a, h) || ReplayEvents(reader, h, a, reporter)) {
+      return true;
+    }
+    reporter.Drain();
+    return false;
+  }
+
+  DynamicAnalyzer a{h.num_threads};
+  StateDumper dumper{a, w, policy};
+  SetViolationHandlers(a, dumper);
+  if (RegisterNames(a, h)) {
+    return true;
+  }
+  dumper.Begin();
+  return ReplayEvents(reader, h, a, dumper);
+}
+
+int Usage() {
+  std::cerr << "Usage: analyzer [--dump <mode>] [--record <trace> |"
+               " --replay <trace> [--batch | --workers <n>]]\n"
+            << "  --dump <mode>     when to print the state: off, violation,"
+               " full, or a number N\n"
+            << "                    to print every Nth event"
+               " (default: full for the model, off for --replay)\n"
+            << "  --record <trace>  run the built-in model"
+               " and save its events\n"
+            << "  --replay <trace>  analyze events saved in <trace>\n"
+            << "  --batch           buffer races during --replay and print"
+               " each distinct race\n"
+            << "                    once per batch of events\n"
+            << "  --workers <n>     check variables of --replay in <n> threads"
+               " and print\n"
+            << "                    each distinct race once at the end"
+            << std::endl;
+  return 1;
+}
+
+// ParseDumpPolicy returns true if s is not a valid dump mode.
+bool ParseDumpPolicy(const char* s, DumpPolicy& policy) {
+  if (strcmp(s, "off") == 0) {
+    policy = {DumpMode::kOff, 0};
+  } else if (strcmp(s, "violation") == 0) {
+    policy = {DumpMode::kViolation, 0};
+  } else if (strcmp(s, "full") == 0) {
+    policy = {DumpMode::kFull, 0};
+  } else {
+    long n = 0;
+    auto [end, ec] = std::from_chars(s, s + strlen(s), n);
+    if (ec != std::errc{} || *end != '\0' || n <= 0) {
+      return true;
+    }
+    policy = {DumpMode::kEveryN, n};
+  }
+  return false;
+}
+
+int main(int argc, char** argv) {
+  const char* record_path = nullptr;
+  const char* replay_path = nullptr;
+  const char* dump_mode = nullptr;
+  bool batch = false;
+  long num_workers = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dump_mode = argv[++i];
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      num_workers = strtol(argv[++i], nullptr, 10);
+      if (num_workers <= 0) {
+        return Usage();
+      }
+    } else {
+      return Usage();
+    }
+  }
+
+  DumpPolicy policy{replay_path ? DumpMode::kOff : DumpMode::kFull, 0};
+  if (dump_mode && ParseDumpPolicy(dump_mode, policy)) {
+    return Usage();
+  }
+  if ((batch || num_workers > 0) && (!replay_path || dump_mode)) {
+    return Usage();
+  }
+  if (batch && num_workers > 0) {
+    return Usage();
+  }
+  if (record_path && replay_path) {
+    return Usage();
+  }
+
+  if (replay_path) {
+    return Replay(replay_path, policy, batch, num_workers) ? 1 : 0;
+  }
+
+  if (record_path) {
+    std::ofstream os{record_path, std::ios::binary};
+    if (!os) {
+      std::cerr << "Failed to open file '" << record_path << "'" << std::endl;
+      return 1;
+    }
+    TraceWriter recorder{os};
+    RunModel(&recorder, policy);
+  } else {
+    RunModel(nullptr, policy);
+  }
+}
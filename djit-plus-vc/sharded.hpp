@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fixed.hpp"
+
+// SpscQueue is a bounded lock-free queue between one producer thread
+// and one consumer thread. The capacity must be a power of 2.
+template <class T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity) : buf_(capacity), mask_{capacity - 1} {
+  }
+
+  // TryPush is called by the producer. It returns false if the queue is full.
+  bool TryPush(const T& v) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_cache_ == buf_.size()) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail - head_cache_ == buf_.size()) {
+        return false;
+      }
+    }
+    buf_[tail & mask_] = v;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // TryPop is called by the consumer. It returns false if the queue is empty.
+  bool TryPop(T& v) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    v = buf_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  std::vector<T> buf_;
+  const size_t mask_;
+
+  // The consumer's index and its copy of the producer's index,
+  // and vice versa, live on separate cache lines.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+};
+
+// ShardedAnalyzer checks data races like BasicAnalyzer, spreading the
+// variables over worker threads.
+//
+// The calling thread acts as the sequencer: it keeps the thread and lock
+// clocks and handles Acquire and Release itself. Read and Write are sent,
+// together with the current clock of the thread, to the worker owning the
+// variable (x.index % num_workers) through an SpscQueue. Each worker keeps
+// the AccessHistory of its own variables, so the checks of different
+// variables run in parallel.
+//
+// A thread clock is never modified after it has been sent. Acquire and
+// Release make a new copy, and the old one is recycled once every worker
+// has processed the events that refer to it.
+template <class Clock>
+class ShardedAnalyzer {
+ public:
+  ShardedAnalyzer(size_t num_threads, size_t num_workers)
+    : workers_(std::max<size_t>(num_workers, 1)) {
+    for (size_t t = 0; t < num_threads; ++t) {
+      auto ct = std::make_unique<Clock>();
+      (*ct)[t] = 1;
+      thread_vc_.push_back(std::move(ct));
+    }
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i].thread = std::thread{[this, i] { RunWorker(i); }};
+    }
+  }
+  ShardedAnalyzer(const ShardedAnalyzer&) = delete;
+  ShardedAnalyzer& operator =(const ShardedAnalyzer&) = delete;
+  ~ShardedAnalyzer() {
+    Finish();
+  }
+
+  size_t NumWorkers() const {
+    return workers_.size();
+  }
+
+  void Read(int t, VariableId x) {
+    Dispatch(t, x, ViolationKind::kRead);
+  }
+  void Write(int t, VariableId x) {
+    Dispatch(t, x, ViolationKind::kWrite);
+  }
+  void Acquire(int t, LockId m) {
+    ++num_events_;
+    Clock& ct = NewThreadClock(t);
+    ct |= LockClock(m);
+  }
+  void Release(int t, LockId m) {
+    ++num_events_;
+    LockClock(m) = *thread_vc_[t];
+    Clock& ct = NewThreadClock(t);
+    ++ct[t];
+  }
+
+  // Finish waits for the workers to process all events and returns the
+  // races they found, ordered by event index.
+  std::vector<ViolationRecord> Finish() {
+    std::vector<ViolationRecord> records;
+    for (auto& w : workers_) {
+      if (!w.thread.joinable()) {
+        continue;
+      }
+      Push(w, Event{0, nullptr, 0, 0, kStop});
+      w.thread.join();
+      records.insert(records.end(), w.records.begin(), w.records.end());
+      w.records.clear();
+    }
+    std::sort(records.begin(), records.end(),
+              [](const auto& a, const auto& b) { return a.event < b.event; });
+    return records;
+  }
+
+ private:
+  static constexpr size_t kQueueSize = 1 << 14;
+  static constexpr size_t kReclaimThreshold = 1024;
+  static constexpr uint8_t kStop = 0xff;
+
+  struct Event {
+    uint64_t seq;      // event index, counted from 0
+    const Clock* ct;   // clock of thread t at this event
+    uint32_t x;        // index of the variable within the worker
+    int32_t t;
+    uint8_t op;        // ViolationKind or kStop
+  };
+
+  struct Worker {
+    SpscQueue<Event> queue{kQueueSize};
+    // done is one past the index of the last processed event.
+    alignas(64) std::atomic<uint64_t> done{0};
+    // pushed is one past the index of the last event sent to the worker.
+    // Only the sequencer touches it.
+    alignas(64) uint64_t pushed = 0;
+    std::vector<ViolationRecord> records;
+    std::thread thread;
+  };
+
+  void Dispatch(int t, VariableId x, ViolationKind kind) {
+    const uint64_t seq = num_events_++;
+    auto& w = workers_[x.index % workers_.size()];
+    const uint32_t local = x.index / workers_.size();
+    Push(w, Event{seq, thread_vc_[t].get(), local, t,
+                  static_cast<uint8_t>(kind)});
+    w.pushed = seq + 1;
+  }
+
+  void Push(Worker& w, const Event& ev) {
+    while (!w.queue.TryPush(ev)) {
+      std::this_thread::yield();
+    }
+  }
+
+  void RunWorker(size_t index) {
+    auto& w = workers_[index];
+    AccessHistory<Clock> history;
+    const size_t num_workers = workers_.size();
+    Event ev;
+    for (;;) {
+      if (!w.queue.TryPop(ev)) {
+        std::this_thread::yield();
+        continue;
+      }
+      if (ev.op == kStop) {
+        break;
+      }
+
+      if (ev.x >= history.size()) {
+        history.Resize(ev.x + 1);
+      }
+      const auto kind = static_cast<ViolationKind>(ev.op);
+      const int other = kind == ViolationKind::kRead
+        ? history.Read(ev.x, ev.t, *ev.ct)
+        : history.Write(ev.x, ev.t, *ev.ct);
+      if (other != AccessHistory<Clock>::kNoRace) {
+        w.records.push_back(ViolationRecord{
+          ev.seq, static_cast<uint32_t>(ev.t),
+          static_cast<uint32_t>(ev.x * num_workers + index),
+          static_cast<uint32_t>(other), kind
+        });
+      }
+      w.done.store(ev.seq + 1, std::memory_order_release);
+    }
+  }
+
+  Clock& LockClock(LockId m) {
+    if (m.index >= lock_vc_.size()) {
+      lock_vc_.resize(m.index + 1);
+    }
+    return lock_vc_[m.index];
+  }
+
+  // NewThreadClock replaces the clock of thread t with a copy that can be
+  // modified. The old clock is retired as it may still be referenced by
+  // events waiting in the queues.
+  Clock& NewThreadClock(int t) {
+    std::unique_ptr<Clock> ct;
+    if (free_.empty()) {
+      ct = std::make_unique<Clock>(*thread_vc_[t]);
+    } else {
+      ct = std::move(free_.back());
+      free_.pop_back();
+      *ct = *thread_vc_[t];
+    }
+    retired_.emplace_back(num_events_, std::move(thread_vc_[t]));
+    thread_vc_[t] = std::move(ct);
+    if (retired_.size() >= kReclaimThreshold) {
+      Reclaim();
+    }
+    return *thread_vc_[t];
+  }
+
+  // Reclaim recycles retired clocks that no pending event refers to.
+  // A clock retired at event s is only referred to by events before s,
+  // and every event still pending in a worker is at or after its done.
+  void Reclaim() {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (auto& w : workers_) {
+      const uint64_t done = w.done.load(std::memory_order_acquire);
+      if (done < w.pushed) {
+        oldest = std::min(oldest, done);
+      }
+    }
+    while (!retired_.empty() && retired_.front().first <= oldest) {
+      free_.push_back(std::move(retired_.front().second));
+      retired_.pop_front();
+    }
+  }
+
+  std::vector<Worker> workers_;
+  std::vector<std::unique_ptr<Clock>> thread_vc_;
+  std::vector<Clock> lock_vc_;
+  std::deque<std::pair<uint64_t, std::unique_ptr<Clock>>> retired_;
+  std::vector<std::unique_ptr<Clock>> free_;
+  uint64_t num_events_ = 0;
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary event trace.
+//
+//   trace  := header event*
+//   header := "DJTR" version num_threads
+//             num_variables name* num_locks name*
+//   name   := length byte*
+//   event  := thread op object
+//
+// num_threads is 1 to kMaxTraceThreads, and every thread, variable and
+// lock of an event must be declared by the header.
+// Every integer is an unsigned LEB128 varint. Variables and locks are
+// referred to by their index in the header, which is the same as the
+// handle Analyzer::Register returns when they are registered in order.
+
+enum class TraceOp : uint32_t {
+  kRead = 0,
+  kWrite = 1,
+  kAcquire = 2,
+  kRelease = 3,
+};
+
+struct TraceEvent {
+  uint32_t t;
+  TraceOp op;
+  uint32_t object;
+};
+
+struct TraceHeader {
+  uint32_t num_threads;
+  std::vector<std::string> variables;
+  std::vector<std::string> locks;
+};
+
+inline constexpr char kTraceMagic[4] = {'D', 'J', 'T', 'R'};
+inline constexpr uint32_t kTraceVersion = 1;
+// kMaxTraceThreads bounds num_threads of a header, since analyzers
+// allocate clocks for every thread up front.
+inline constexpr uint32_t kMaxTraceThreads = 4096;
+
+// TraceWriter encodes a trace into a stream.
+// Events are buffered and written in large blocks.
+class TraceWriter {
+ public:
+  explicit TraceWriter(std::ostream& os) : os_{os} {}
+  ~TraceWriter() {
+    Flush();
+  }
+
+  void WriteHeader(const TraceHeader& h) {
+    buf_.append(kTraceMagic, sizeof(kTraceMagic));
+    PutVarint(kTraceVersion);
+    PutVarint(h.num_threads);
+    for (const auto* names : {&h.variables, &h.locks}) {
+      PutVarint(names->size());
+      for (const auto& name : *names) {
+        PutVarint(name.size());
+        buf_ += name;
+      }
+    }
+  }
+
+  void Append(const TraceEvent& ev) {
+    PutVarint(ev.t);
+    PutVarint(static_cast<uint32_t>(ev.op));
+    PutVarint(ev.object);
+    if (buf_.size() >= kFlushSize) {
+      Flush();
+    }
+  }
+
+  void Flush() {
+    os_.write(buf_.data(), buf_.size());
+    buf_.clear();
+  }
+
+ private:
+  static constexpr size_t kFlushSize = 1 << 16;
+
+  void PutVarint(uint64_t v) {
+    while (v >= 0x80) {
+      buf_ += static_cast<char>(v | 0x80);
+      v >>= 7;
+    }
+    buf_ += static_cast<char>(v);
+  }
+
+  std::ostream& os_;
+  std::string buf_;
+};
+
+// TraceReader decodes a trace held in memory without copying it.
+class TraceReader {
+ public:
+  TraceReader(const uint8_t* begin, const uint8_t* end)
+    : p_{begin}, end_{end} {
+  }
+
+  // ReadHeader returns true if the header is malformed.
+  bool ReadHeader(TraceHeader& h) {
+    if (end_ - p_ < static_cast<ptrdiff_t>(sizeof(kTraceMagic)) ||
+        std::memcmp(p_, kTraceMagic, sizeof(kTraceMagic)) != 0) {
+      std::cerr << "Not a trace file" << std::endl;
+      return true;
+    }
+    p_ += sizeof(kTraceMagic);
+
+    uint32_t version;
+    if (!GetVarint(version) || version != kTraceVersion) {
+      std::cerr << "Unsupported trace version" << std::endl;
+      return true;
+    }
+    if (!GetVarint(h.num_threads)) {
+      return Malformed("header");
+    }
+    if (h.num_threads == 0 || h.num_threads > kMaxTraceThreads) {
+      std::cerr << "Invalid number of threads " << h.num_threads
+                << " (must be 1 to " << kMaxTraceThreads << ")" << std::endl;
+      return true;
+    }
+    for (auto* names : {&h.variables, &h.locks}) {
+      uint32_t n;
+      if (!GetVarint(n)) {
+        return Malformed("header");
+      }
+      names->clear();
+      for (uint32_t i = 0; i < n; ++i) {
+        uint32_t len;
+        if (!GetVarint(len) || static_cast<size_t>(end_ - p_) < len) {
+          return Malformed("names table");
+        }
+        names->emplace_back(reinterpret_cast<const char*>(p_), len);
+        p_ += len;
+      }
+    }
+    return false;
+  }
+
+  // Next decodes the next event. It returns false at the end of the trace
+  // or if the trace is truncated, in which case Failed() becomes true.
+  bool Next(TraceEvent& ev) {
+    if (p_ == end_) {
+      return false;
+    }
+    uint32_t op;
+    if (!GetVarint(ev.t) || !GetVarint(op) || !GetVarint(ev.object)) {
+      failed_ = true;
+      return false;
+    }
+    ev.op = static_cast<TraceOp>(op);
+    return true;
+  }
+
+  bool Failed() const {
+    return failed_;
+  }
+
+ private:
+  bool Malformed(const char* what) {
+    std::cerr << "Malformed trace " << what << std::endl;
+    return true;
+  }
+
+  bool GetVarint(uint32_t& v) {
+    if (p_ < end_ && *p_ < 0x80) {
+      v = *p_++;
+      return true;
+    }
+    uint64_t r = 0;
+    for (int shift = 0; shift < 35 && p_ < end_; shift += 7) {
+      const uint8_t b = *p_++;
+      r |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (b < 0x80) {
+        v = r;
+        return r <= UINT32_MAX;
+      }
+    }
+    return false;
+  }
+
+  const uint8_t* p_;
+  const uint8_t* end_;
+  bool failed_ = false;
+};
+
+// MappedFile maps a whole file read-only into memory.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator =(const MappedFile&) = delete;
+  ~MappedFile() {
+    if (data_) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+  }
+
+  // Open returns true on failure.
+  bool Open(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      auto err = strerror(errno);
+      std::cerr << "Failed to open file '" << path << "': " << err << std::endl;
+      return true;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+      std::cerr << "Failed to get the size of '" << path << "'" << std::endl;
+      close(fd);
+      return true;
+    }
+
+    void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+      auto err = strerror(errno);
+      std::cerr << "Failed to map file '" << path << "': " << err << std::endl;
+      return true;
+    }
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+
+    data_ = static_cast<const uint8_t*>(m);
+    size_ = st.st_size;
+    return false;
+  }
+
+  const uint8_t* begin() const {
+    return data_;
+  }
+  const uint8_t* end() const {
+    return data_ + size_;
+  }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
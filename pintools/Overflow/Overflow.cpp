@@ -6,7 +6,16 @@
 
 #include "pin.H"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "ShadowBytes.hpp"
 
 using namespace std;
 
@@ -21,6 +30,9 @@ std::ostream * out = &cerr;
 /* ===================================================================== */
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,  "pintool",
     "o", "", "specify file name for MyPinTool output");
+KNOB<UINT64> KnobQuarantineSize(KNOB_MODE_WRITEONCE, "pintool",
+    "quarantine_size", "268435456",
+    "number of bytes of freed objects kept from being reused");
 
 /* ===================================================================== */
 // Utilities
@@ -38,51 +50,241 @@ INT32 Usage() {
   return -1;
 }
 
+class LockGuard {
+ public:
+  LockGuard(PIN_LOCK& l) : l_{l} {
+    PIN_GetLock(&l_, PIN_ThreadId());
+  }
+
+  ~LockGuard() {
+    PIN_ReleaseLock(&l_);
+  }
+
+ private:
+  PIN_LOCK& l_;
+};
+
 /* ===================================================================== */
 // Analysis routines
 /* ===================================================================== */
 
+// out_lock serializes reports.
+PIN_LOCK out_lock;
+
 struct HeapObject {
   ADDRINT addr;
   size_t size;
 };
 
 /*!
- * heap_objs records objects allocated by malloc().
+ * shadow marks the bytes of heap objects as addressable.
+ * Bytes of freed objects in the quarantine are poisoned with kHeapFreed,
+ * others with 0.
+ */
+ShadowBytes shadow;
+constexpr int8_t kHeapFreed = -1;
+
+/*!
+ * QuarantinedObject is a freed object which is not yet returned
+ * to the allocator.
+ */
+struct QuarantinedObject {
+  HeapObject obj;
+  AFUNPTR dealloc;  // the function which freed the object
+  bool sized;       // true if dealloc takes the size as well
+};
+
+/*!
+ * HeapShard holds the heap objects whose addresses map to it, so that
+ * threads allocating and freeing different objects rarely contend.
+ * lock protects the rest of the shard. It is taken only by the allocator
+ * wrappers, and never while calling application functions. Memory
+ * accesses are checked against shadow without any lock.
+ *
+ * objs records live heap objects, keyed by their addresses. An object
+ * is removed in O(1) when it is freed, so the size of objs follows the
+ * live heap.
+ *
+ * quarantine holds freed objects in the order freed so that accesses to
+ * them are detected until the allocator reuses them.
+ * quarantine_bytes is the cost of the objects in it, which is kept
+ * below the shard's share of KnobQuarantineSize by evicting the oldest
+ * ones. Addresses spread over the shards, so the oldest objects of all
+ * shards together are still roughly the oldest ones freed.
+ */
+struct alignas(64) HeapShard {
+  PIN_LOCK lock;
+  unordered_map<ADDRINT, HeapObject> objs;
+  deque<QuarantinedObject> quarantine;
+  UINT64 quarantine_bytes = 0;
+};
+
+constexpr size_t kNumHeapShards = 16;
+HeapShard heap_shards[kNumHeapShards];
+
+/*!
+ * ShardOf returns the shard of the object at addr.
+ * Objects are aligned to 16 bytes, so the lower bits are dropped.
+ * @param[in]  addr  address of the object
  */
-vector<HeapObject> heap_objs;
+HeapShard& ShardOf(ADDRINT addr) {
+  return heap_shards[((addr >> 4) ^ (addr >> 12)) % kNumHeapShards];
+}
 
 /*!
- * CheckOverflow detects out-of-bounds memory access.
- * An access is out-of-bounds if mem_addr doesn't match any of heap objects.
+ * IsOutOfBounds is the inlined check of a memory access.
+ * An access is out-of-bounds if it isn't inside any of heap objects.
+ * Every granule of an access up to ShadowBytes::kMaxCheckedSize bytes
+ * is checked, so a vector access straddling a redzone is caught.
+ * @param[in]  mem_addr  effective address of the memory operand
+ * @param[in]  size      size of the memory operand
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL IsOutOfBounds(ADDRINT mem_addr, UINT32 size) {
+  return !shadow.IsAddressable(mem_addr, size);
+}
+
+/*!
+ * CheckOverflow reports an out-of-bounds memory access.
+ * It is called only if IsOutOfBounds() returns non-zero.
  * @param[in]  ins_addr  address of the memory-access instruction
  * @param[in]  mem_addr  effective address of the memory operand
  * @param[in]  is_write  true if the memory operand is written
  */
 void CheckOverflow(ADDRINT ins_addr, ADDRINT mem_addr, BOOL is_write) {
-  bool out_of_bound = true;
-  for (auto& heap_obj : heap_objs) {
-    if (heap_obj.addr <= mem_addr && mem_addr < heap_obj.addr + heap_obj.size) {
-      out_of_bound = false;
-      break;
-    }
+  const char* type = is_write ? "write" : "read";
+  const char* kind = shadow.Get(mem_addr) == kHeapFreed
+                     ? "use-after-free" : "out-of-bounds";
+  LockGuard guard{out_lock};
+  *out << hex << "Found " << kind << " memory " << type
+       << " at 0x" << mem_addr << " (IP=0x" << ins_addr << ")" << endl;
+}
+
+atomic<bool> main_started{false};
+
+void OnMainStarted() {
+  main_started.store(true, memory_order_relaxed);
+}
+
+/*!
+ * RecordAlloc adds an object allocated after main() started to its
+ * shard and makes it addressable.
+ * @param[in]  ptr   address of the object, or nullptr if allocation failed
+ * @param[in]  size  size of the object
+ */
+void RecordAlloc(void* ptr, size_t size) {
+  if (!main_started.load(memory_order_relaxed) || ptr == nullptr) {
+    return;
   }
-  if (out_of_bound) {
-    const char* type = is_write ? "write" : "read";
-    *out << hex << "Found out-of-bounds memory " << type
-         << " at 0x" << mem_addr << " (IP=0x" << ins_addr << ")" << endl;
+  // No other thread can see the object yet, so the shadow is
+  // updated outside the lock.
+  const auto addr = reinterpret_cast<ADDRINT>(ptr);
+  shadow.Unpoison(addr, size);
+  HeapShard& shard = ShardOf(addr);
+  LockGuard guard{shard.lock};
+  shard.objs[addr] = HeapObject{addr, size};
+}
+
+/*!
+ * Deallocate returns an object to the allocator.
+ * @param[in]  ctx      context of the caller
+ * @param[in]  dealloc  free(), operator delete or operator delete[]
+ * @param[in]  sized    true if dealloc takes the size as well
+ * @param[in]  ptr      object to be freed
+ * @param[in]  size     size of the object, passed if sized is true
+ */
+void Deallocate(CONTEXT* ctx, AFUNPTR dealloc, bool sized,
+                void* ptr, size_t size) {
+  if (sized) {
+    PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                                dealloc, nullptr,
+                                PIN_PARG(void),
+                                PIN_PARG(void*), ptr,
+                                PIN_PARG(size_t), size,
+                                PIN_PARG_END());
+  } else {
+    PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                                dealloc, nullptr,
+                                PIN_PARG(void),
+                                PIN_PARG(void*), ptr,
+                                PIN_PARG_END());
   }
 }
 
-bool main_started = false;
+/*!
+ * QuarantineCost returns the number of bytes an object is charged
+ * in the quarantine. The bookkeeping is included so that many tiny
+ * objects can't exceed the budget either.
+ * @param[in]  obj  object in the quarantine
+ */
+UINT64 QuarantineCost(const HeapObject& obj) {
+  return obj.size + sizeof(QuarantinedObject);
+}
 
-void OnMainStarted() {
-  main_started = true;
+/*!
+ * RecordFree removes an object from its shard, poisons it with kHeapFreed
+ * and puts it into the shard's quarantine instead of freeing it. Then the
+ * oldest objects of the shard are evicted and freed until its quarantine
+ * fits its budget, which takes O(1) amortized time as each object is
+ * evicted only once. Unknown objects, e.g. allocated before main(), are
+ * freed at once. Objects already in a quarantine are reported as double
+ * free. The bookkeeping is done under the shard's lock, but the objects
+ * are freed after releasing it since the allocator may call back into
+ * the wrappers.
+ * @param[in]  ctx      context of the caller
+ * @param[in]  dealloc  free(), operator delete or operator delete[]
+ * @param[in]  sized    true if dealloc takes the size as well
+ * @param[in]  ptr      object to be freed
+ * @param[in]  size     size passed to dealloc if sized is true
+ */
+void RecordFree(CONTEXT* ctx, AFUNPTR dealloc, bool sized,
+                void* ptr, size_t size) {
+  const auto addr = reinterpret_cast<ADDRINT>(ptr);
+  vector<QuarantinedObject> evicted;
+  HeapShard& shard = ShardOf(addr);
+  PIN_GetLock(&shard.lock, PIN_ThreadId());
+  auto it = shard.objs.find(addr);
+  if (it == shard.objs.end()) {
+    const bool double_free = ptr != nullptr && shadow.Get(addr) == kHeapFreed;
+    PIN_ReleaseLock(&shard.lock);
+    if (double_free) {
+      LockGuard guard{out_lock};
+      *out << hex << "Found double free of 0x" << addr << endl;
+      return;
+    }
+    Deallocate(ctx, dealloc, sized, ptr, size);
+    return;
+  }
+
+  const HeapObject obj = it->second;
+  shard.objs.erase(it);
+  // Even an empty object occupies a granule, which is poisoned to
+  // detect double free.
+  shadow.Poison(obj.addr, max<size_t>(obj.size, 1), kHeapFreed);
+  shard.quarantine.push_back(QuarantinedObject{obj, dealloc, sized});
+  shard.quarantine_bytes += QuarantineCost(obj);
+
+  const UINT64 budget = KnobQuarantineSize.Value() / kNumHeapShards;
+  while (shard.quarantine_bytes > budget) {
+    const QuarantinedObject& q = shard.quarantine.front();
+    shard.quarantine_bytes -= QuarantineCost(q.obj);
+    shadow.Poison(q.obj.addr, max<size_t>(q.obj.size, 1), 0);
+    evicted.push_back(q);
+    shard.quarantine.pop_front();
+  }
+  PIN_ReleaseLock(&shard.lock);
+
+  for (const auto& q : evicted) {
+    Deallocate(ctx, q.dealloc, q.sized,
+               reinterpret_cast<void*>(q.obj.addr), q.obj.size);
+  }
 }
 
 /*!
- * JitMalloc calls malloc() and logs its argument and result into heap_objs.
- * @param[in]  ctx  
+ * JitMalloc calls malloc(), operator new or operator new[]
+ * and records the allocated object.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  size           number of bytes to be allocated
  */
 void* JitMalloc(CONTEXT* ctx, AFUNPTR orig_func_ptr, size_t size) {
   void* ret;
@@ -91,12 +293,181 @@ void* JitMalloc(CONTEXT* ctx, AFUNPTR orig_func_ptr, size_t size) {
                               PIN_PARG(void*), &ret,
                               PIN_PARG(size_t), size,
                               PIN_PARG_END());
-  if (main_started) {
-    heap_objs.emplace_back(reinterpret_cast<ADDRINT>(ret), size);
+  RecordAlloc(ret, size);
+  return ret;
+}
+
+/*!
+ * JitCalloc calls calloc() and records the allocated object.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  nmemb          number of elements
+ * @param[in]  size           size of an element
+ */
+void* JitCalloc(CONTEXT* ctx, AFUNPTR orig_func_ptr,
+                size_t nmemb, size_t size) {
+  void* ret;
+  PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                              orig_func_ptr, nullptr,
+                              PIN_PARG(void*), &ret,
+                              PIN_PARG(size_t), nmemb,
+                              PIN_PARG(size_t), size,
+                              PIN_PARG_END());
+  // calloc() fails if nmemb * size overflows, so the product is exact here.
+  RecordAlloc(ret, nmemb * size);
+  return ret;
+}
+
+/*!
+ * JitMemalign calls memalign() or aligned_alloc()
+ * and records the allocated object.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  alignment      alignment of the object
+ * @param[in]  size           number of bytes to be allocated
+ */
+void* JitMemalign(CONTEXT* ctx, AFUNPTR orig_func_ptr,
+                  size_t alignment, size_t size) {
+  void* ret;
+  PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                              orig_func_ptr, nullptr,
+                              PIN_PARG(void*), &ret,
+                              PIN_PARG(size_t), alignment,
+                              PIN_PARG(size_t), size,
+                              PIN_PARG_END());
+  RecordAlloc(ret, size);
+  return ret;
+}
+
+/*!
+ * JitPosixMemalign calls posix_memalign() and records the allocated
+ * object if it succeeded.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  memptr         where the address of the object is stored
+ * @param[in]  alignment      alignment of the object
+ * @param[in]  size           number of bytes to be allocated
+ */
+int JitPosixMemalign(CONTEXT* ctx, AFUNPTR orig_func_ptr,
+                     void** memptr, size_t alignment, size_t size) {
+  int ret;
+  PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                              orig_func_ptr, nullptr,
+                              PIN_PARG(int), &ret,
+                              PIN_PARG(void**), memptr,
+                              PIN_PARG(size_t), alignment,
+                              PIN_PARG(size_t), size,
+                              PIN_PARG_END());
+  if (ret == 0) {
+    RecordAlloc(*memptr, size);
+  }
+  return ret;
+}
+
+/*!
+ * JitPvalloc calls pvalloc(), which rounds the size up to a multiple
+ * of the page size, and records the whole pages as the object.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  size           number of bytes to be allocated
+ */
+void* JitPvalloc(CONTEXT* ctx, AFUNPTR orig_func_ptr, size_t size) {
+  constexpr size_t kPageSize = 4096;
+  void* ret;
+  PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                              orig_func_ptr, nullptr,
+                              PIN_PARG(void*), &ret,
+                              PIN_PARG(size_t), size,
+                              PIN_PARG_END());
+  RecordAlloc(ret, max<size_t>((size + kPageSize - 1) & ~(kPageSize - 1),
+                               kPageSize));
+  return ret;
+}
+
+/*!
+ * JitRealloc replaces realloc().
+ * A known object is always moved to a new object allocated by
+ * realloc(nullptr, size) so that the old one can be quarantined.
+ * Like glibc, realloc(ptr, 0) frees ptr and returns nullptr.
+ * The old object is left as is if allocation fails.
+ * An object in the quarantine is reported and never passed to the
+ * allocator, which would free it again when it is evicted.
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  orig_free      free() of the image supplying realloc(),
+ *                            used to release a moved object, or nullptr
+ * @param[in]  ptr            object to be resized, or nullptr
+ * @param[in]  size           new size of the object
+ */
+void* JitRealloc(CONTEXT* ctx, AFUNPTR orig_func_ptr, AFUNPTR orig_free,
+                 void* ptr, size_t size) {
+  const auto addr = reinterpret_cast<ADDRINT>(ptr);
+  bool move = false;
+  bool freed = false;
+  size_t old_size = 0;
+  {
+    HeapShard& shard = ShardOf(addr);
+    LockGuard guard{shard.lock};
+    auto it = shard.objs.find(addr);
+    if (it != shard.objs.end()) {
+      move = orig_free != nullptr;
+      old_size = it->second.size;
+    } else {
+      freed = ptr != nullptr && shadow.Get(addr) == kHeapFreed;
+    }
+  }
+  if (freed) {
+    LockGuard guard{out_lock};
+    *out << hex << "Found use-after-free realloc of 0x" << addr << endl;
+    return nullptr;
+  }
+  void* ret = nullptr;
+  if (!move || size > 0) {
+    PIN_CallApplicationFunction(ctx, PIN_ThreadId(), CALLINGSTD_DEFAULT,
+                                orig_func_ptr, nullptr,
+                                PIN_PARG(void*), &ret,
+                                PIN_PARG(void*), move ? nullptr : ptr,
+                                PIN_PARG(size_t), size,
+                                PIN_PARG_END());
+  }
+  if (!move) {
+    RecordAlloc(ret, size);
+    return ret;
+  }
+
+  if (size > 0) {
+    if (ret == nullptr) {
+      return nullptr;
+    }
+    memcpy(ret, ptr, min(old_size, size));
   }
+  RecordFree(ctx, orig_free, false, ptr, 0);
+  RecordAlloc(ret, size);
   return ret;
 }
 
+/*!
+ * JitFree replaces free(), operator delete and operator delete[].
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  ptr            object to be freed
+ */
+void JitFree(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* ptr) {
+  RecordFree(ctx, orig_func_ptr, false, ptr, 0);
+}
+
+/*!
+ * JitSizedFree replaces the sized operator delete and operator delete[].
+ * @param[in]  ctx            context of the caller
+ * @param[in]  orig_func_ptr  the replaced function
+ * @param[in]  ptr            object to be freed
+ * @param[in]  size           size of the object
+ */
+void JitSizedFree(CONTEXT* ctx, AFUNPTR orig_func_ptr,
+                  void* ptr, size_t size) {
+  RecordFree(ctx, orig_func_ptr, true, ptr, size);
+}
+
 /* ===================================================================== */
 // Instrumentation callbacks
 /* ===================================================================== */
@@ -107,6 +478,7 @@ UINT32 main_rtn_id;
 /*!
  * ObserveMemAccess inserts call to the CheckOverflow() analysis routine
  * before every memory-accessing instructions inside main().
+ * The call is guarded by IsOutOfBounds(), which Pin can inline.
  * @param[in]  trace  trace to be instrumented
  */
 VOID ObserveMemAccess(TRACE trace, VOID*) {
@@ -128,7 +500,13 @@ VOID ObserveMemAccess(TRACE trace, VOID*) {
           continue;
         }
 
-        INS_InsertCall(
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE, reinterpret_cast<AFUNPTR>(IsOutOfBounds),
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memop,
+            IARG_UINT32, INS_MemoryOperandSize(ins, memop),
+            IARG_END);
+        INS_InsertThenCall(
             ins, IPOINT_BEFORE, reinterpret_cast<AFUNPTR>(CheckOverflow),
             IARG_INST_PTR,
             IARG_MEMORYOP_EA, memop,
@@ -140,18 +518,93 @@ VOID ObserveMemAccess(TRACE trace, VOID*) {
 }
 
 /*!
- * ReplaceMalloc replaces malloc() with a wrapper, JitMalloc().
+ * replaced_rtns holds the addresses of replaced routines. A routine
+ * can be replaced only once, and some names are aliases of another
+ * one, e.g. aligned_alloc() of memalign() in older glibc.
+ */
+set<ADDRINT> replaced_rtns;
+
+/*!
+ * ReplaceFunc replaces the routine named name with wrapper.
+ * The wrapper receives the context, the original function and
+ * the first num_args arguments, up to 3.
+ * Returns the original function, or nullptr if there is no such routine
+ * or it is already replaced.
+ * @param[in]  img       image to be instrumented
+ * @param[in]  name      name of the routine to be replaced
+ * @param[in]  wrapper   replacement routine
+ * @param[in]  num_args  number of arguments of the routine
+ */
+AFUNPTR ReplaceFunc(IMG img, const char* name,
+                    AFUNPTR wrapper, int num_args) {
+  RTN rtn = RTN_FindByName(img, name);
+  if (!RTN_Valid(rtn) || !replaced_rtns.insert(RTN_Address(rtn)).second) {
+    return nullptr;
+  }
+  if (num_args == 1) {
+    return RTN_ReplaceSignature(rtn, wrapper,
+        IARG_CONTEXT,
+        IARG_ORIG_FUNCPTR,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_END);
+  }
+  if (num_args == 2) {
+    return RTN_ReplaceSignature(rtn, wrapper,
+        IARG_CONTEXT,
+        IARG_ORIG_FUNCPTR,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+        IARG_END);
+  }
+  return RTN_ReplaceSignature(rtn, wrapper,
+      IARG_CONTEXT,
+      IARG_ORIG_FUNCPTR,
+      IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+      IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+      IARG_FUNCARG_ENTRYPOINT_VALUE, 2,
+      IARG_END);
+}
+
+/*!
+ * ReplaceAllocators replaces malloc(), free() and their relatives,
+ * including operator new and delete, with wrappers.
  * @param[in]  img  image to be instrumented
  */
-VOID ReplaceMalloc(IMG img, VOID*) {
-  RTN malloc_rtn = RTN_FindByName(img, "malloc");
-  if (RTN_Valid(malloc_rtn)) {
-    RTN_ReplaceSignature(malloc_rtn, reinterpret_cast<AFUNPTR>(JitMalloc),
+VOID ReplaceAllocators(IMG img, VOID*) {
+  const auto malloc_fn = reinterpret_cast<AFUNPTR>(JitMalloc);
+  const auto free_fn = reinterpret_cast<AFUNPTR>(JitFree);
+  const auto sized_free_fn = reinterpret_cast<AFUNPTR>(JitSizedFree);
+
+  ReplaceFunc(img, "malloc", malloc_fn, 1);
+  ReplaceFunc(img, "calloc", reinterpret_cast<AFUNPTR>(JitCalloc), 2);
+  ReplaceFunc(img, "memalign", reinterpret_cast<AFUNPTR>(JitMemalign), 2);
+  ReplaceFunc(img, "aligned_alloc",
+              reinterpret_cast<AFUNPTR>(JitMemalign), 2);
+  ReplaceFunc(img, "posix_memalign",
+              reinterpret_cast<AFUNPTR>(JitPosixMemalign), 3);
+  ReplaceFunc(img, "valloc", malloc_fn, 1);
+  ReplaceFunc(img, "pvalloc", reinterpret_cast<AFUNPTR>(JitPvalloc), 1);
+  const AFUNPTR orig_free = ReplaceFunc(img, "free", free_fn, 1);
+
+  // An object moved by realloc() is released by free() of the same
+  // image, which is the allocator that owns it.
+  RTN realloc_rtn = RTN_FindByName(img, "realloc");
+  if (RTN_Valid(realloc_rtn) &&
+      replaced_rtns.insert(RTN_Address(realloc_rtn)).second) {
+    RTN_ReplaceSignature(realloc_rtn, reinterpret_cast<AFUNPTR>(JitRealloc),
         IARG_CONTEXT,
         IARG_ORIG_FUNCPTR,
+        IARG_PTR, reinterpret_cast<void*>(orig_free),
         IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
         IARG_END);
   }
+  ReplaceFunc(img, "_Znwm", malloc_fn, 1);         // operator new
+  ReplaceFunc(img, "_Znam", malloc_fn, 1);         // operator new[]
+  ReplaceFunc(img, "_ZdlPv", free_fn, 1);          // operator delete
+  ReplaceFunc(img, "_ZdaPv", free_fn, 1);          // operator delete[]
+  ReplaceFunc(img, "_ZdlPvm", sized_free_fn, 2);   // sized operator delete
+  ReplaceFunc(img, "_ZdaPvm", sized_free_fn, 2);   // sized operator delete[]
 }
 
 /*!
@@ -180,7 +633,16 @@ VOID InsertMainMarker(IMG img, VOID*) {
 VOID Fini(INT32 code, VOID* v) {
   *out << "===============================================" << endl;
   *out << "Heap Objects:" << endl;
-  for (auto& heap_obj : heap_objs) {
+  vector<HeapObject> objs;
+  for (auto& shard : heap_shards) {
+    for (auto& [addr, heap_obj] : shard.objs) {
+      objs.push_back(heap_obj);
+    }
+  }
+  sort(objs.begin(), objs.end(), [](const auto& a, const auto& b) {
+    return a.addr < b.addr;
+  });
+  for (auto& heap_obj : objs) {
     *out << hex << " addr=0x" << heap_obj.addr
          << ", size=0x" << heap_obj.size << endl;
   }
@@ -196,16 +658,25 @@ VOID Fini(INT32 code, VOID* v) {
  */
 int main(int argc, char** argv) {
   PIN_InitSymbols();
+  for (auto& shard : heap_shards) {
+    PIN_InitLock(&shard.lock);
+  }
+  PIN_InitLock(&out_lock);
 
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
 
+  if (shadow.Init()) {
+    cerr << "Failed to reserve shadow memory" << endl;
+    return 1;
+  }
+
   if (!KnobOutputFile.Value().empty()) {
     out = new std::ofstream(KnobOutputFile.Value().c_str());
   }
 
-  IMG_AddInstrumentFunction(ReplaceMalloc, 0);
+  IMG_AddInstrumentFunction(ReplaceAllocators, 0);
   IMG_AddInstrumentFunction(InsertMainMarker, 0);
   TRACE_AddInstrumentFunction(ObserveMemAccess, 0);
   PIN_AddFiniFunction(Fini, 0);
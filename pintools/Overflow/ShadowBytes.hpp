@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+/*!
+ * ShadowBytes records which application bytes are addressable,
+ * with one shadow byte for each granule of 8 bytes.
+ *
+ * A shadow byte from 0 to 8 is the number of addressable bytes at the
+ * beginning of the granule, so 0 means the whole granule is poisoned.
+ * Negative values are also poisoned and tell why.
+ *
+ * The shadow bytes are stored in pages of kPageSize bytes. The first
+ * level table holds, for each page, its offset from a shared read-only
+ * page of zeros. The table is reserved with MAP_NORESERVE, so an entry
+ * that was never written is 0 and refers to the zero page. That is,
+ * memory is poisoned until it is unpoisoned, and Get() needs no branch.
+ *
+ * Pages are installed with compare-and-swap, so Get() never blocks and
+ * Unpoison() and Poison() may be called from several threads at once
+ * as long as they touch different granules. The bytes of an object
+ * are written only by the thread allocating or freeing it.
+ */
+class ShadowBytes {
+ public:
+  static constexpr int kGranuleBits = 3;
+  static constexpr int kAddrBits = 47;
+  static constexpr int kPageBits = 20;
+  static constexpr size_t kPageSize = size_t{1} << kPageBits;
+  static constexpr size_t kNumPages =
+      size_t{1} << (kAddrBits - kGranuleBits - kPageBits);
+  static constexpr size_t kMaxCheckedSize = 32;
+
+  /*!
+   * Init reserves the tables. Returns true on failure.
+   */
+  bool Init() {
+    zero_page_ = reinterpret_cast<uintptr_t>(Reserve(kPageSize, PROT_READ));
+    offsets_ = static_cast<Offset*>(
+        Reserve(kNumPages * sizeof(Offset), PROT_READ | PROT_WRITE));
+    return zero_page_ == 0 || offsets_ == nullptr;
+  }
+
+  /*!
+   * Get returns the shadow byte of the granule containing addr.
+   * Addresses out of the address space wrap around.
+   * @param[in]  addr  application address
+   */
+  int8_t Get(uintptr_t addr) const {
+    const uintptr_t g = addr >> kGranuleBits;
+    const uintptr_t page = zero_page_ +
+        offsets_[(g >> kPageBits) & (kNumPages - 1)].load(
+            std::memory_order_acquire);
+    return reinterpret_cast<const int8_t*>(page)[g & (kPageSize - 1)];
+  }
+
+  /*!
+   * IsAddressable returns true if every byte of [addr, addr + size) is
+   * addressable. Each granule the access overlaps is checked, up to
+   * kMaxCheckedSize bytes, which covers a 32-byte AVX access at any
+   * alignment. Of a longer access, such as XSAVE, the bytes between the
+   * first kMaxCheckedSize and the last one are not checked.
+   * It has no branches so that Pin can inline it.
+   * @param[in]  addr  application address
+   * @param[in]  size  number of bytes accessed, at least 1
+   */
+  bool IsAddressable(uintptr_t addr, size_t size) const {
+    const uintptr_t last = addr + size - 1;
+    return Covers(addr, last) &
+           Covers(std::min(addr + 8, last), last) &
+           Covers(std::min(addr + 16, last), last) &
+           Covers(std::min(addr + 24, last), last) &
+           Covers(last, last);
+  }
+
+  /*!
+   * Unpoison makes [addr, addr + size) addressable.
+   * @param[in]  addr  application address aligned to 8 bytes
+   * @param[in]  size  number of bytes
+   */
+  void Unpoison(uintptr_t addr, size_t size) {
+    Fill(addr, size >> kGranuleBits, 8);
+    if (size & 7) {
+      Fill(addr + (size & ~size_t{7}), 1, static_cast<int8_t>(size & 7));
+    }
+  }
+
+  /*!
+   * Poison makes the granules overlapping [addr, addr + size)
+   * not addressable.
+   * @param[in]  addr   application address aligned to 8 bytes
+   * @param[in]  size   number of bytes
+   * @param[in]  value  0 or a negative value telling why
+   */
+  void Poison(uintptr_t addr, size_t size, int8_t value) {
+    Fill(addr, (size + 7) >> kGranuleBits, value);
+  }
+
+ private:
+  using Offset = std::atomic<intptr_t>;
+
+  static void* Reserve(size_t bytes, int prot) {
+    void* p = mmap(nullptr, bytes, prot,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  // Covers returns true if the bytes of the granule containing p are
+  // addressable from p up to last or the end of the granule.
+  bool Covers(uintptr_t p, uintptr_t last) const {
+    const uintptr_t end = std::min<uintptr_t>(last - (p & ~uintptr_t{7}), 7);
+    return static_cast<int>(end) + 1 <= Get(p);
+  }
+
+  // WritablePage returns the shadow page of granule g,
+  // allocating it if it still refers to the zero page.
+  // A thread losing the race to install a page unmaps its own.
+  int8_t* WritablePage(uintptr_t g) {
+    Offset& slot = offsets_[(g >> kPageBits) & (kNumPages - 1)];
+    intptr_t offset = slot.load(std::memory_order_acquire);
+    if (offset == 0) {
+      void* page = Reserve(kPageSize, PROT_READ | PROT_WRITE);
+      if (page == nullptr) {
+        return nullptr;
+      }
+      const intptr_t fresh = reinterpret_cast<uintptr_t>(page) - zero_page_;
+      if (slot.compare_exchange_strong(offset, fresh,
+                                       std::memory_order_acq_rel)) {
+        offset = fresh;
+      } else {
+        munmap(page, kPageSize);
+      }
+    }
+    return reinterpret_cast<int8_t*>(zero_page_ + offset);
+  }
+
+  // Fill sets n shadow bytes from the granule of addr to value.
+  void Fill(uintptr_t addr, size_t n, int8_t value) {
+    uintptr_t g = addr >> kGranuleBits;
+    while (n > 0) {
+      const size_t i = g & (kPageSize - 1);
+      const size_t len = n < kPageSize - i ? n : kPageSize - i;
+      int8_t* page = WritablePage(g);
+      if (page == nullptr) {
+        return;
+      }
+      memset(page + i, value, len);
+      g += len;
+      n -= len;
+    }
+  }
+
+  // zero_page_ is the address of the shared page of zeros.
+  uintptr_t zero_page_ = 0;
+  Offset* offsets_ = nullptr;
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+#include <type_traits>
+
+/*!
+ * ShadowMemory maps an application address to a shadow cell of type T.
+ * Addresses in the same granule of 2^granule_shift bytes share a cell.
+ *
+ * The first level table indexed by the upper bits of an address is
+ * reserved by Init(). A second level page, holding the cells of
+ * 2^kPageBits consecutive granules inline, is allocated when a cell in
+ * it is first requested. Both are mapped with MAP_NORESERVE so that only
+ * the touched parts consume physical memory: sizeof(T) bytes per granule
+ * in use, with no allocation per cell.
+ *
+ * T must be trivially copyable, and a cell of all zero bytes is its
+ * initial state. Find() is a couple of loads regardless of the number of
+ * cells. Pages are installed with compare-and-swap, so FindOrAdd() may
+ * be called concurrently with Find() and itself; the cells themselves
+ * are protected by the caller. None of them may be called until Init()
+ * succeeds.
+ */
+template <class T>
+class ShadowMemory {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+ public:
+  static constexpr int kAddrBits = 47;
+  static constexpr int kPageBits = 20;
+  static constexpr size_t kPageSize = size_t{1} << kPageBits;
+  static constexpr uintptr_t kOsPageSize = 4096;
+
+  ShadowMemory() = default;
+  ShadowMemory(const ShadowMemory&) = delete;
+  ShadowMemory& operator =(const ShadowMemory&) = delete;
+
+  /*!
+   * Init reserves the first level table.
+   * Returns true if it couldn't be reserved.
+   * @param[in]  granule_shift  log2 of the number of bytes sharing a cell
+   */
+  bool Init(int granule_shift) {
+    shift_ = granule_shift;
+    num_pages_ = size_t{1} << (kAddrBits - kPageBits - granule_shift);
+    pages_ = static_cast<Page*>(Reserve(num_pages_ * sizeof(Page)));
+    return pages_ == nullptr;
+  }
+
+  /*!
+   * Granule returns the first address of the granule containing addr.
+   * @param[in]  addr  application address
+   */
+  uintptr_t Granule(uintptr_t addr) const {
+    return addr >> shift_ << shift_;
+  }
+
+  // GranuleSize returns the number of bytes sharing a cell.
+  size_t GranuleSize() const {
+    return size_t{1} << shift_;
+  }
+
+  /*!
+   * MayContain returns false if the page of addr has no cells.
+   * It is a single load without branches so that Pin can inline it
+   * into an If analysis routine. Addresses out of the address space
+   * wrap around, which only causes false positives.
+   * @param[in]  addr  application address
+   */
+  bool MayContain(uintptr_t addr) const {
+    const uintptr_t i = addr >> (shift_ + kPageBits);
+    return pages_[i & (num_pages_ - 1)].load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * Find returns the cell of addr, or nullptr if its page has no cells.
+   * @param[in]  addr  application address
+   */
+  T* Find(uintptr_t addr) const {
+    const uintptr_t g = addr >> shift_;
+    if ((g >> kPageBits) >= num_pages_) {
+      return nullptr;
+    }
+    T* page = pages_[g >> kPageBits].load(std::memory_order_acquire);
+    if (page == nullptr) {
+      return nullptr;
+    }
+    return &page[g & (kPageSize - 1)];
+  }
+
+  /*!
+   * FindOrAdd returns the cell of addr, allocating its page if needed.
+   * Returns nullptr if addr is out of the address space or the page
+   * couldn't be allocated.
+   * @param[in]  addr  application address
+   */
+  T* FindOrAdd(uintptr_t addr) {
+    const uintptr_t g = addr >> shift_;
+    if ((g >> kPageBits) >= num_pages_) {
+      return nullptr;
+    }
+
+    Page& slot = pages_[g >> kPageBits];
+    T* page = slot.load(std::memory_order_acquire);
+    if (page == nullptr) {
+      T* fresh = static_cast<T*>(Reserve(kPageSize * sizeof(T)));
+      if (fresh == nullptr) {
+        return nullptr;
+      }
+      if (slot.compare_exchange_strong(page, fresh,
+                                       std::memory_order_acq_rel)) {
+        page = fresh;
+      } else {
+        munmap(fresh, kPageSize * sizeof(T));
+      }
+    }
+    return &page[g & (kPageSize - 1)];
+  }
+
+  /*!
+   * Discard returns the memory holding the cells of the granules inside
+   * [addr, addr + size) to the OS, after which they read as zero. Only
+   * whole OS pages of cells are returned, so cells of granules partly
+   * outside the range, or sharing an OS page with one outside it, are
+   * kept. Pages without cells are skipped.
+   * @param[in]  addr  first address of the range
+   * @param[in]  size  number of bytes in the range
+   */
+  void Discard(uintptr_t addr, size_t size) {
+    uintptr_t g = (addr + GranuleSize() - 1) >> shift_;
+    const uintptr_t end = (addr + size) >> shift_;
+    while (g < end && (g >> kPageBits) < num_pages_) {
+      const uintptr_t page_end = ((g >> kPageBits) + 1) << kPageBits;
+      const uintptr_t stop = page_end < end ? page_end : end;
+      T* page = pages_[g >> kPageBits].load(std::memory_order_acquire);
+      if (page != nullptr) {
+        const uintptr_t first =
+            reinterpret_cast<uintptr_t>(&page[g & (kPageSize - 1)]);
+        const uintptr_t last =
+            reinterpret_cast<uintptr_t>(&page[(stop - 1) & (kPageSize - 1)]);
+        const uintptr_t lo = (first + kOsPageSize - 1) & ~(kOsPageSize - 1);
+        const uintptr_t hi = (last + sizeof(T)) & ~(kOsPageSize - 1);
+        if (lo < hi) {
+          madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED);
+        }
+      }
+      g = stop;
+    }
+  }
+
+  /*!
+   * ForEachInRange calls f(granule, cell) for each existing cell of the
+   * granules overlapping [addr, addr + size), where granule is the first
+   * address of the cell's granule. Pages without cells are skipped.
+   * @param[in]  addr  first address of the range
+   * @param[in]  size  number of bytes in the range
+   * @param[in]  f     function to be called
+   */
+  template <class F>
+  void ForEachInRange(uintptr_t addr, size_t size, F f) {
+    if (size == 0) {
+      return;
+    }
+    uintptr_t g = addr >> shift_;
+    const uintptr_t end = ((addr + size - 1) >> shift_) + 1;
+    while (g < end && (g >> kPageBits) < num_pages_) {
+      const uintptr_t page_end = ((g >> kPageBits) + 1) << kPageBits;
+      const uintptr_t stop = page_end < end ? page_end : end;
+      T* page = pages_[g >> kPageBits].load(std::memory_order_acquire);
+      if (page != nullptr) {
+        for (; g < stop; ++g) {
+          f(g << shift_, page[g & (kPageSize - 1)]);
+        }
+      }
+      g = stop;
+    }
+  }
+
+ private:
+  using Page = std::atomic<T*>;
+
+  static void* Reserve(size_t bytes) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  int shift_ = 0;
+  size_t num_pages_ = 0;
+  Page* pages_ = nullptr;
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// JoinClocks stores the elementwise maximum of dst and src into dst.
+template <class T>
+void JoinClocks(T* dst, const T* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = std::max(dst[i], src[i]);
+  }
+}
+
+inline void JoinClocks(int* dst, const int* src, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i < n / 4 * 4; i += 4) {
+    auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    auto gt = _mm_cmpgt_epi32(s, d);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm_or_si128(_mm_and_si128(gt, s),
+                                  _mm_andnot_si128(gt, d)));
+  }
+#endif
+  for (; i < n; ++i) {
+    dst[i] = std::max(dst[i], src[i]);
+  }
+}
+
+// ClocksLessEq returns true if lhs[i] <= rhs[i] for all i.
+template <class T>
+bool ClocksLessEq(const T* lhs, const T* rhs, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (lhs[i] > rhs[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool ClocksLessEq(const int* lhs, const int* rhs, size_t n) {
+  size_t i = 0;
+  int greater = 0;
+#ifdef __SSE2__
+  auto acc = _mm_setzero_si128();
+  for (; i < n / 4 * 4; i += 4) {
+    auto l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+    auto r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + i));
+    acc = _mm_or_si128(acc, _mm_cmpgt_epi32(l, r));
+  }
+  greater |= _mm_movemask_epi8(acc);
+#endif
+  for (; i < n; ++i) {
+    greater |= lhs[i] > rhs[i];
+  }
+  return greater == 0;
+}
+
+/*!
+ * VC is a vector clock indexed by thread id.
+ *
+ * A clock starts sparse: up to kNumSparse (thread id, value) pairs are
+ * stored inline without allocation. Most variables and locks are only
+ * touched by one or two threads, so their clocks stay sparse.
+ * When a third thread appears the clock becomes dense, an array indexed
+ * by thread id which is joined and compared with SIMD. A dense clock
+ * never shrinks, so assigning to it allocates only when it has to grow.
+ */
+template <class T>
+class VC {
+ public:
+  static constexpr uint32_t kNumSparse = 2;
+  static constexpr uint32_t kMinDenseSize = 8;
+
+  VC() = default;
+  VC(uint32_t tid, T value) {
+    (*this)[tid] = value;
+  }
+  VC(const VC& rhs) {
+    *this = rhs;
+  }
+  ~VC() {
+    delete[] dense_;
+  }
+
+  VC& operator =(const VC& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+
+    if (rhs.dense_ == nullptr) {
+      if (dense_ == nullptr) {
+        size_ = rhs.size_;
+        std::copy_n(rhs.tids_, size_, tids_);
+        std::copy_n(rhs.values_, size_, values_);
+      } else {
+        std::fill_n(dense_, size_, T{});
+        for (uint32_t i = 0; i < rhs.size_; ++i) {
+          (*this)[rhs.tids_[i]] = rhs.values_[i];
+        }
+      }
+      return *this;
+    }
+
+    Reserve(rhs.size_);
+    std::copy_n(rhs.dense_, rhs.size_, dense_);
+    std::fill(dense_ + rhs.size_, dense_ + size_, T{});
+    return *this;
+  }
+
+  T& operator [](uint32_t tid) {
+    if (dense_ == nullptr) {
+      for (uint32_t i = 0; i < size_; ++i) {
+        if (tids_[i] == tid) {
+          return values_[i];
+        }
+      }
+      if (size_ < kNumSparse) {
+        tids_[size_] = tid;
+        values_[size_] = T{};
+        return values_[size_++];
+      }
+      Reserve(tid + 1);
+    } else if (tid >= size_) {
+      Reserve(tid + 1);
+    }
+    return dense_[tid];
+  }
+
+  /*!
+   * Get returns the value for tid without inserting it.
+   * @param[in]  tid  thread id
+   */
+  T Get(uint32_t tid) const {
+    if (dense_ != nullptr) {
+      return tid < size_ ? dense_[tid] : T{};
+    }
+    for (uint32_t i = 0; i < size_; ++i) {
+      if (tids_[i] == tid) {
+        return values_[i];
+      }
+    }
+    return T{};
+  }
+
+  VC& operator |=(const VC& rhs) {
+    if (rhs.dense_ == nullptr) {
+      for (uint32_t i = 0; i < rhs.size_; ++i) {
+        if (Get(rhs.tids_[i]) < rhs.values_[i]) {
+          (*this)[rhs.tids_[i]] = rhs.values_[i];
+        }
+      }
+      return *this;
+    }
+
+    Reserve(rhs.size_);
+    JoinClocks(dense_, rhs.dense_, rhs.size_);
+    return *this;
+  }
+
+  bool operator <=(const VC& rhs) const {
+    if (dense_ == nullptr) {
+      for (uint32_t i = 0; i < size_; ++i) {
+        if (values_[i] > rhs.Get(tids_[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    if (rhs.dense_ == nullptr) {
+      for (uint32_t tid = 0; tid < size_; ++tid) {
+        if (dense_[tid] > rhs.Get(tid)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    const uint32_t n = std::min(size_, rhs.size_);
+    if (!ClocksLessEq(dense_, rhs.dense_, n)) {
+      return false;
+    }
+    for (uint32_t tid = n; tid < size_; ++tid) {
+      if (dense_[tid] > T{}) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool operator >(const VC& rhs) const {
+    return !(*this <= rhs);
+  }
+
+  /*!
+   * ForEach calls f(tid, value) for each non-zero value
+   * in ascending order of tid.
+   * @param[in]  f  function to be called
+   */
+  template <class F>
+  void ForEach(F f) const {
+    if (dense_ != nullptr) {
+      for (uint32_t tid = 0; tid < size_; ++tid) {
+        if (dense_[tid] != T{}) {
+          f(tid, dense_[tid]);
+        }
+      }
+      return;
+    }
+
+    uint32_t order[kNumSparse];
+    for (uint32_t i = 0; i < size_; ++i) {
+      order[i] = i;
+    }
+    std::sort(order, order + size_, [this](uint32_t a, uint32_t b) {
+      return tids_[a] < tids_[b];
+    });
+    for (uint32_t i = 0; i < size_; ++i) {
+      if (values_[order[i]] != T{}) {
+        f(tids_[order[i]], values_[order[i]]);
+      }
+    }
+  }
+
+ private:
+  // Reserve makes the clock dense with at least n entries.
+  void Reserve(uint32_t n) {
+    if (dense_ != nullptr && n <= size_) {
+      return;
+    }
+
+    uint32_t new_size = std::max(n, kMinDenseSize);
+    if (dense_ != nullptr) {
+      new_size = std::max(new_size, size_ * 2);
+    } else {
+      for (uint32_t i = 0; i < size_; ++i) {
+        new_size = std::max(new_size, tids_[i] + 1);
+      }
+    }
+
+    T* d = new T[new_size]();
+    if (dense_ != nullptr) {
+      std::copy_n(dense_, size_, d);
+    } else {
+      for (uint32_t i = 0; i < size_; ++i) {
+        d[tids_[i]] = values_[i];
+      }
+    }
+    delete[] dense_;
+    dense_ = d;
+    size_ = new_size;
+  }
+
+  // dense_ is nullptr while the clock is sparse.
+  T* dense_ = nullptr;
+  // size_ is the number of pairs if sparse, or of entries if dense.
+  uint32_t size_ = 0;
+  uint32_t tids_[kNumSparse];
+  T values_[kNumSparse];
+};
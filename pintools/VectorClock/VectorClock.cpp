@@ -4,13 +4,21 @@
 
 #include "pin.H"
 #include <cxxabi.h>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
+#include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include "Elf.hpp"
+#include "Shadow.hpp"
+#include "VC.hpp"
 
 using namespace std;
 
@@ -19,104 +27,343 @@ using namespace std;
 /* ================================================================== */
 
 std::ostream * out = &cerr;
+// out_buf is the buffer of the output file, large enough that reports
+// drained by threads are written with few system calls.
+char out_buf[1 << 20];
 
+// lock serializes output to *out. It is never taken for a single
+// access: the trace of watched accesses and race reports are appended
+// to the log of each thread and written in bulk by DrainReports().
 PIN_LOCK lock;
-PIN_LOCK vc_lock;
+// thread_lock protects pending_forks and exited_vc.
+PIN_LOCK thread_lock;
 
-template <class T>
-class VC {
- public:
-  VC() : clocks_{} {}
-  VC(THREADID tid, T value) : clocks_{} {
-    clocks_[tid] = value;
-  }
-
-  T& operator [](THREADID tid) {
-    return clocks_[tid];
-  }
-  map<THREADID, T>::iterator find(THREADID tid) {
-    return clocks_.find(tid);
-  }
-  map<THREADID, T>::const_iterator find(THREADID tid) const {
-    return clocks_.find(tid);
-  }
+// Vector clocks of a variable or a lock are protected by one of the
+// stripe locks chosen by its address, so that threads accessing
+// different locations don't contend with each other.
+const size_t kNumStripes = 256;
 
-  VC& operator |=(const VC<T>& rhs) {
-    for (auto [tid, v] : rhs.clocks_) {
-      if (clocks_[tid] < v) {
-        clocks_[tid] = v;
-      }
-    }
-    return *this;
-  }
+struct alignas(64) StripeLock {
+  PIN_LOCK l;
+};
+StripeLock stripe_locks[kNumStripes];
 
-  bool operator <=(const VC<T>& rhs) const {
-    for (auto [tid, v] : clocks_) {
-      auto it = rhs.clocks_.find(tid);
-      if (it == rhs.clocks_.end() && v > 0) {
-        return false;
-      } else if (v > it->second) {
-        return false;
-      }
-    }
-    return true;
-  }
+PIN_LOCK& LockFor(ADDRINT addr) {
+  return stripe_locks[(addr >> 3) % kNumStripes].l;
+}
 
-  bool operator >(const VC<T>& rhs) const {
-    return !(*this <= rhs);
+class LockGuard {
+ public:
+  LockGuard(PIN_LOCK& l) : l_{l} {
+    PIN_GetLock(&l_, PIN_ThreadId());
   }
 
-  auto begin() const noexcept {
-    return clocks_.begin();
-  }
-  auto end() const noexcept {
-    return clocks_.end();
+  ~LockGuard() {
+    PIN_ReleaseLock(&l_);
   }
 
  private:
-  map<THREADID, T> clocks_;
+  PIN_LOCK& l_;
 };
 
 template <class T>
 ostream& operator <<(ostream& os, const VC<T>& vc) {
   char sep = '<';
-  for (auto [k, v] : vc) {
+  vc.ForEach([&](THREADID k, T v) {
     os << sep << 'T' << k << ':' << v;
     sep = ',';
+  });
+  if (sep == '<') {
+    os << sep;
   }
   os << '>';
   return os;
 }
 
+/*!
+ * ThreadVCMap holds the vector clock of each thread in a slot indexed by
+ * THREADID. A slot is only accessed by its owner thread, and by Fini()
+ * after all threads end, so no lock is needed to access it.
+ */
 template <class T>
 class ThreadVCMap {
  public:
   VC<T>& operator [](THREADID tid) {
-    if (m_.count(tid) == 0) {
-      m_[tid][tid] = 1;
+    auto& slot = slots_[tid];
+    if (!slot.started) {
+      if (slot.vc.Get(tid) == T{}) {
+        slot.vc[tid] = 1;
+      }
+      slot.started = true;
     }
-    return m_[tid];
+    return slot.vc;
+  }
+
+  bool Started(THREADID tid) const {
+    return slots_[tid].started;
+  }
+
+  // Reset clears the slot of an exited thread, whose THREADID may be
+  // given to a new thread. The thread's own entry is kept and advanced:
+  // other clocks may still hold its last value for this THREADID, and
+  // the new thread's accesses must not look ordered before them.
+  void Reset(THREADID tid) {
+    auto& slot = slots_[tid];
+    const T last = slot.vc.Get(tid);
+    slot.started = false;
+    slot.vc = VC<T>{tid, last + 1};
+  }
+
+ private:
+  struct alignas(64) Slot {
+    bool started;
+    VC<T> vc;
+  };
+  Slot slots_[PIN_MAX_THREADS];
+};
+
+/*!
+ * SiteTable numbers the memory-accessing instructions, so that a shadow
+ * cell can name the last accesses with 32-bit ids instead of IPs.
+ * Ids are given at instrumentation time, which Pin serializes, and the
+ * table never moves, so analysis routines read it without a lock.
+ * Id 0 stands for an unknown instruction.
+ */
+class SiteTable {
+ public:
+  static constexpr size_t kMaxSites = size_t{1} << 24;
+
+  // Init reserves the table. Returns true on failure.
+  bool Init() {
+    void* p = mmap(nullptr, kMaxSites * sizeof(ADDRINT),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ips_ = p == MAP_FAILED ? nullptr : static_cast<ADDRINT*>(p);
+    return ips_ == nullptr;
   }
 
-  auto begin() const noexcept {
-    return m_.begin();
+  /*!
+   * Add returns the id of the instruction at ip, numbering it if new.
+   * @param[in]  ip  address of the instruction
+   */
+  UINT32 Add(ADDRINT ip) {
+    auto [it, inserted] = ids_.try_emplace(ip, 0);
+    if (inserted && next_ < kMaxSites) {
+      ips_[next_] = ip;
+      it->second = next_++;
+    }
+    return it->second;
   }
-  auto end() const noexcept {
-    return m_.end();
+
+  ADDRINT Ip(UINT32 site) const {
+    return ips_[site];
   }
 
  private:
-  map<THREADID, VC<T>> m_;
+  ADDRINT* ips_ = nullptr;
+  UINT32 next_ = 1;
+  unordered_map<ADDRINT, UINT32> ids_;
 };
 
+/*!
+ * VarCell is the access history of a granule, stored inline in var_vc.
+ * As in FastTrack, the last write is an epoch (thread and its clock
+ * value). Reads stay an epoch while they are ordered, and are inflated
+ * to a vector clock in shared_reads only when two reads are concurrent.
+ * The ids of the last read and write name the previous access of a race.
+ * A cell of zeros is a granule nobody has accessed yet.
+ */
+struct VarCell {
+  static constexpr uint16_t kSharedRead = 0xffff;
+
+  uint32_t write_clock;
+  uint32_t read_clock;  // slot in shared_reads if read_tid is kSharedRead
+  uint16_t write_tid;
+  uint16_t read_tid;
+  UINT32 write_site;
+  UINT32 read_site;
+  bool watched;         // true if the granule is watched without -watch_all
+
+  // Empty returns true if the granule has no accesses to forget.
+  bool Empty() const {
+    return write_clock == 0 && read_clock == 0 && read_tid != kSharedRead;
+  }
+};
+static_assert(PIN_MAX_THREADS < VarCell::kSharedRead);
+
+/*!
+ * SharedReads holds the read vector clocks of granules whose reads
+ * are concurrent. A clock is referred to by its slot from a VarCell and
+ * is accessed with the cell's stripe lock held. Slots are allocated in
+ * chunks that never move and are reused once their granule is written
+ * or freed.
+ */
+class SharedReads {
+ public:
+  SharedReads() {
+    PIN_InitLock(&lock_);
+  }
+
+  static constexpr UINT32 kNoSlot = ~UINT32{0};
+
+  // Alloc returns a slot holding an empty clock, or kNoSlot if full.
+  UINT32 Alloc() {
+    LockGuard l{lock_};
+    if (!free_.empty()) {
+      const UINT32 slot = free_.back();
+      free_.pop_back();
+      return slot;
+    }
+    if (size_ == kChunkSize * kMaxChunks) {
+      return kNoSlot;
+    }
+    if (size_ % kChunkSize == 0) {
+      chunks_[size_ / kChunkSize] = new VC<int>[kChunkSize];
+    }
+    return size_++;
+  }
+
+  void Free(UINT32 slot) {
+    (*this)[slot] = VC<int>{};
+    LockGuard l{lock_};
+    free_.push_back(slot);
+  }
+
+  VC<int>& operator [](UINT32 slot) {
+    return chunks_[slot / kChunkSize][slot % kChunkSize];
+  }
+
+ private:
+  static constexpr UINT32 kChunkSize = 4096;
+  static constexpr UINT32 kMaxChunks = 1 << 16;
+
+  PIN_LOCK lock_;
+  UINT32 size_ = 0;
+  VC<int>* chunks_[kMaxChunks] = {};
+  vector<UINT32> free_;
+};
+
+// Access is a memory access to a watched variable.
+struct Access {
+  UINT32 site;
+  BOOL is_write;
+  ADDRINT mem_addr;
+  VarCell* var;
+};
+
+/*!
+ * AccessBuffer holds the accesses of a thread not checked yet.
+ * The clock of a thread doesn't change between synchronization points,
+ * so checking them later gives the same result as checking each one
+ * at once, while the instrumented path only appends an entry.
+ */
+struct AccessBuffer {
+  static constexpr size_t kCapacity = 1024;
+  size_t size = 0;
+  Access accesses[kCapacity];
+};
+
+enum class ReportKind : uint8_t {
+  kRead,
+  kWrite,
+  kReadRace,
+  kWriteRace,
+};
+
+/*!
+ * Report is a binary record of a watched access or a race.
+ * It is formatted only when the log holding it is drained.
+ * A race is recorded as the epochs (thread and its clock value) of the
+ * two accesses, so that no clock is copied in the analysis routine.
+ */
+struct Report {
+  ReportKind kind;
+  THREADID tid;
+  int clock;
+  ADDRINT ins_addr;
+  ADDRINT mem_addr;
+  // The previous access racing with this one. Unused for kRead and kWrite.
+  THREADID prev_tid;
+  int prev_clock;
+  ADDRINT prev_ip;
+};
+
+/*!
+ * ReportLog holds the reports of a thread not written yet.
+ * Reports are only appended while stripe locks are held. The log is
+ * drained once it holds kDrainSize reports, after the locks are
+ * released, so threads don't contend on the output lock for every
+ * report. A flush of an AccessBuffer adds at most two reports per
+ * access, which always fit in the remaining capacity.
+ */
+struct ReportLog {
+  static constexpr size_t kDrainSize = 2048;
+  static constexpr size_t kCapacity =
+      kDrainSize + 2 * AccessBuffer::kCapacity;
+  size_t size = 0;
+  Report reports[kCapacity];
+};
+
+// ThreadData is the state of each thread stored in a Pin TLS slot.
+// sync_args is a stack of arguments of the pthread functions being
+// called, kept inline so that lock hooks never allocate. Pushes beyond
+// kMaxSyncArgs are counted but not stored.
+// [freed_begin, freed_end) is the last block forgotten by free(), which
+// the allocator may munmap() right after.
+struct ThreadData {
+  static constexpr size_t kMaxSyncArgs = 16;
+  AccessBuffer accesses;
+  ReportLog reports;
+  size_t num_sync_args = 0;
+  ADDRINT sync_args[kMaxSyncArgs];
+  ADDRINT freed_begin = 0;
+  ADDRINT freed_end = 0;
+};
+
+// thread_data_key is the TLS key of ThreadData.
+TLS_KEY thread_data_key = INVALID_TLS_KEY;
+// live_threads holds the ThreadData of running threads, so that Fini()
+// can check and write what threads alive at exit have buffered.
+ThreadData* live_threads[PIN_MAX_THREADS];
+
+ThreadData* DataOf(THREADID tid) {
+  return static_cast<ThreadData*>(PIN_GetThreadData(thread_data_key, tid));
+}
+
 ThreadVCMap<int> thread_vc;
-map<ADDRINT, VC<int>> read_vc, write_vc, lock_vc;
+SiteTable sites;
+// Pages of cells are installed atomically, so lookups need no lock.
+// A cell is accessed with LockFor() of its address held.
+// lock_vc has a cell for each byte, var_vc for each -granularity bytes.
+ShadowMemory<VarCell> var_vc;
+ShadowMemory<VC<int>*> lock_vc;
+SharedReads shared_reads;
+// watched_addrs holds the granules watched by -watch and -watch_pattern
+// in the order added, printed by Fini().
+vector<ADDRINT> watched_addrs;
+// watch_all is true if every access not relative to the stack or IP
+// is checked, creating cells on demand.
+bool watch_all = false;
 
 /* ===================================================================== */
 // Command line switches
 /* ===================================================================== */
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,  "pintool",
     "o", "", "specify file name for MyPinTool output");
+KNOB<UINT32> KnobRaceReportLimit(KNOB_MODE_WRITEONCE, "pintool",
+    "race_limit", "1",
+    "number of reports printed for each pair of racing IPs and address");
+KNOB<UINT32> KnobGranularity(KNOB_MODE_WRITEONCE, "pintool",
+    "granularity", "4",
+    "number of bytes sharing vector clocks: 1, 4 or 8");
+KNOB<string> KnobWatchVars(KNOB_MODE_APPEND, "pintool",
+    "watch", "x", "name of a global variable to be watched");
+KNOB<string> KnobWatchPattern(KNOB_MODE_APPEND, "pintool",
+    "watch_pattern", "",
+    "watch global variables whose names match this pattern"
+    " ('*' matches any string, '?' any character)");
+KNOB<BOOL> KnobWatchAll(KNOB_MODE_WRITEONCE, "pintool",
+    "watch_all", "0", "watch all global and heap memory");
 
 /* ===================================================================== */
 // Utilities
@@ -146,31 +393,49 @@ string Demangle(const char* symbol) {
   return s;
 }
 
-class LockGuard {
- public:
-  LockGuard(PIN_LOCK& l) : l_{l} {
-    PIN_GetLock(&l_, PIN_ThreadId());
+/*!
+ * MatchPattern returns true if s matches pattern, where '*' matches
+ * any string and '?' matches any character.
+ * @param[in]  pattern  the pattern
+ * @param[in]  s        string to be matched
+ */
+bool MatchPattern(const char* pattern, const char* s) {
+  const char* star = nullptr;
+  const char* resume = nullptr;
+  while (*s) {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = s;
+    } else if (*pattern == '?' || *pattern == *s) {
+      ++pattern;
+      ++s;
+    } else if (star) {
+      pattern = star + 1;
+      s = ++resume;
+    } else {
+      return false;
+    }
   }
-
-  ~LockGuard() {
-    PIN_ReleaseLock(&l_);
+  while (*pattern == '*') {
+    ++pattern;
   }
-
- private:
-  PIN_LOCK& l_;
-};
+  return *pattern == '\0';
+}
 
 /*!
  * Load symbol addresses from the target binary
- * into read_vc, write_vc, and lock_vc.
+ * into var_vc.
+ * Every granule of a watched variable gets a cell, so that accesses to
+ * its elements and fields are also checked.
+ * A name matches either as it is or demangled.
  * @param[in]  argc  the 1st argument of main()
  * @param[in]  argv  the 2nd argument of main()
  * @param[in]  watch_vars  variable names to be watched by this pintool
- * @param[in]  watch_locks  lock names to be watched by this pintool
+ * @param[in]  watch_patterns  patterns of variable names to be watched
  */
 bool LoadSymbolAddrFromTargetBinary(
     int argc, char** argv,
-    const set<string>& watch_vars, const set<string>& watch_locks) {
+    const set<string>& watch_vars, const vector<string>& watch_patterns) {
 
   const char* target_bin_path = nullptr;
   for (int i = argc - 2; i > 0; --i) {
@@ -194,11 +459,29 @@ bool LoadSymbolAddrFromTargetBinary(
     }
 
     const auto addr = sym.st_value;
-    if (watch_vars.count(name)) {
-      read_vc[addr] = VC<int>{};
-      write_vc[addr] = VC<int>{};
-    } else if (watch_locks.count(name)) {
-      lock_vc[addr] = VC<int>{};
+    const auto size = max<size_t>(sym.st_size, 1);
+    const string demangled = Demangle(name.c_str());
+    auto matches = [&](const set<string>& names) {
+      return names.count(name) || names.count(demangled);
+    };
+    auto matches_pattern = [&]() {
+      for (const auto& p : watch_patterns) {
+        if (MatchPattern(p.c_str(), name.c_str()) ||
+            MatchPattern(p.c_str(), demangled.c_str())) {
+          return true;
+        }
+      }
+      return false;
+    };
+    if (matches(watch_vars) || matches_pattern()) {
+      for (ADDRINT a = var_vc.Granule(addr); a < addr + size;
+           a += var_vc.GranuleSize()) {
+        VarCell* c = var_vc.FindOrAdd(a);
+        if (c && !c->watched) {
+          c->watched = true;
+          watched_addrs.push_back(a);
+        }
+      }
     }
   }
 
@@ -209,173 +492,676 @@ bool LoadSymbolAddrFromTargetBinary(
 // Analysis routines
 /* ===================================================================== */
 
-void Read(THREADID tid, ADDRINT mem_addr) {
-  LockGuard l{vc_lock};
-  read_vc[mem_addr][tid] = thread_vc[tid][tid];
+/*!
+ * Covered returns true if the epoch (t, clock) is ordered before the
+ * current access of a thread, whose clock is c.
+ * @param[in]  t      thread of the previous access
+ * @param[in]  clock  clock value of the previous access
+ * @param[in]  c      clock of the current thread
+ */
+bool Covered(THREADID t, int clock, const VC<int>& c) {
+  return clock <= c.Get(t);
 }
 
-void Write(THREADID tid, ADDRINT mem_addr) {
-  LockGuard l{vc_lock};
-  write_vc[mem_addr][tid] = thread_vc[tid][tid];
+// RaceSite identifies a race by the IPs of the two accesses and the address.
+struct RaceSite {
+  ADDRINT ip, prev_ip, mem_addr;
+
+  bool operator <(const RaceSite& rhs) const {
+    return tie(ip, prev_ip, mem_addr) <
+           tie(rhs.ip, rhs.prev_ip, rhs.mem_addr);
+  }
+};
+
+/*!
+ * RaceSiteTable counts how many times each race site is hit, so that
+ * a racy loop is reported a bounded number of times and summarized in
+ * Fini(). The table is split into shards with their own locks.
+ */
+class RaceSiteTable {
+ public:
+  RaceSiteTable() {
+    for (auto& s : shards_) {
+      PIN_InitLock(&s.lock);
+    }
+  }
+
+  /*!
+   * Hit counts a hit of site and returns the number of hits so far.
+   * @param[in]  site  the racing site
+   * @param[in]  kind  kReadRace or kWriteRace
+   */
+  UINT64 Hit(const RaceSite& site, ReportKind kind) {
+    auto& s = shards_[(site.ip ^ site.prev_ip ^ site.mem_addr) % kNumShards];
+    LockGuard l{s.lock};
+    auto [it, inserted] = s.hits.try_emplace(site, kind, 0);
+    return ++it->second.second;
+  }
+
+  /*!
+   * Print prints every race site with its number of hits.
+   * @param[in]  os  output stream
+   */
+  void Print(ostream& os) {
+    for (auto& s : shards_) {
+      LockGuard l{s.lock};
+      for (const auto& [site, hit] : s.hits) {
+        os << (hit.first == ReportKind::kWriteRace ? "Write" : "Read")
+           << " race on 0x" << hex << site.mem_addr
+           << " at IP=0x" << site.ip
+           << " after IP=0x" << site.prev_ip
+           << ": " << dec << hit.second << " times" << endl;
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kNumShards = 64;
+
+  struct alignas(64) Shard {
+    PIN_LOCK lock;
+    map<RaceSite, pair<ReportKind, UINT64>> hits;
+  };
+  Shard shards_[kNumShards];
+};
+
+RaceSiteTable race_sites;
+
+/*!
+ * DrainReports formats the reports in a log and writes them to *out
+ * with a single write. Only the write is done under the output lock.
+ * It must not be called with a stripe lock held.
+ * @param[in]  log  the log to be drained
+ */
+void DrainReports(ReportLog& log) {
+  if (log.size == 0) {
+    return;
+  }
+
+  ostringstream os;
+  for (size_t i = 0; i < log.size; ++i) {
+    const Report& r = log.reports[i];
+    switch (r.kind) {
+    case ReportKind::kWriteRace:
+    case ReportKind::kReadRace:
+      os << (r.kind == ReportKind::kWriteRace ? "Write" : "Read")
+         << " race: T" << r.tid << '@' << r.clock
+         << " after T" << r.prev_tid << '@' << r.prev_clock
+         << hex << " at 0x" << r.mem_addr
+         << " (IP=0x" << r.ins_addr
+         << ", previous IP=0x" << r.prev_ip << ")\n" << dec;
+      break;
+    case ReportKind::kRead:
+    case ReportKind::kWrite:
+      os << hex << "Found "
+         << (r.kind == ReportKind::kWrite ? "write" : "read")
+         << " of a watched variable by thread " << r.tid
+         << " at 0x" << r.mem_addr << " (IP=0x" << r.ins_addr << ")\n"
+         << dec;
+      break;
+    }
+  }
+  log.size = 0;
+
+  const string s = os.str();
+  LockGuard l{lock};
+  out->write(s.data(), s.size());
 }
 
-void Aquire(THREADID tid, ADDRINT lock_addr) {
-  LockGuard l{vc_lock};
-  thread_vc[tid] |= lock_vc[lock_addr];
+/*!
+ * AddReport appends a report to the log of thread tid.
+ * The log is drained by FlushAccesses(), so it never fills up here.
+ * @param[in]  log   the log of the reporting thread
+ * @param[in]  tid   id of the reporting thread
+ * @param[in]  kind  kind of the report
+ * @param[in]  a     the access reported
+ */
+Report& AddReport(ReportLog& log, THREADID tid, ReportKind kind,
+                  const Access& a) {
+  Report& r = log.reports[log.size++];
+  r.kind = kind;
+  r.tid = tid;
+  r.clock = thread_vc[tid][tid];
+  r.ins_addr = sites.Ip(a.site);
+  r.mem_addr = a.mem_addr;
+  return r;
 }
 
-void Release(THREADID tid, ADDRINT lock_addr) {
-  LockGuard l{vc_lock};
-  lock_vc[lock_addr] = thread_vc[tid];
-  ++thread_vc[tid][tid];
+/*!
+ * FindUncovered finds the first thread whose entry in vc is greater
+ * than in the clock c of the current thread, i.e. the epoch of a
+ * previous access which is not ordered before the current one.
+ * Returns false if vc <= c.
+ * @param[in]   vc     clock of previous accesses
+ * @param[in]   c      clock of the current thread
+ * @param[out]  tid    thread of the previous access
+ * @param[out]  clock  clock value of the previous access
+ */
+bool FindUncovered(const VC<int>& vc, const VC<int>& c,
+                   THREADID& tid, int& clock) {
+  bool found = false;
+  vc.ForEach([&](THREADID k, int v) {
+    if (!found && v > c.Get(k)) {
+      tid = k;
+      clock = v;
+      found = true;
+    }
+  });
+  return found;
 }
 
-bool NoRaceForWrite(THREADID tid, ADDRINT mem_addr) {
-  return read_vc[mem_addr] <= thread_vc[tid] &&
-         write_vc[mem_addr] <= thread_vc[tid];
+/*!
+ * ReportRace records a race of access a with the previous access whose
+ * epoch is (prev_tid, prev_clock), unless the pair of IPs and the address
+ * have been reported enough.
+ * @param[in]  log         the log of the accessing thread
+ * @param[in]  tid         id of the accessing thread
+ * @param[in]  kind        kReadRace or kWriteRace
+ * @param[in]  a           the access
+ * @param[in]  prev_tid    thread of the previous access
+ * @param[in]  prev_clock  clock value of the previous access
+ * @param[in]  prev_site   site id of the previous access
+ */
+void ReportRace(ReportLog& log, THREADID tid, ReportKind kind,
+                const Access& a, THREADID prev_tid, int prev_clock,
+                UINT32 prev_site) {
+  const RaceSite site{sites.Ip(a.site), sites.Ip(prev_site), a.mem_addr};
+  if (race_sites.Hit(site, kind) <= KnobRaceReportLimit.Value()) {
+    Report& r = AddReport(log, tid, kind, a);
+    r.prev_tid = prev_tid;
+    r.prev_clock = prev_clock;
+    r.prev_ip = site.prev_ip;
+  }
 }
 
-bool NoRaceForRead(THREADID tid, ADDRINT mem_addr) {
-  return write_vc[mem_addr] <= thread_vc[tid];
+/*!
+ * CheckWrite checks a write against the last write and the reads of a
+ * granule, then makes it the last write.
+ * The reads are forgotten only if they are ordered before the write,
+ * so that one racing with a later access is still reported.
+ * @param[in]  log  the log of the accessing thread
+ * @param[in]  tid  id of the accessing thread
+ * @param[in]  a    the access
+ */
+void CheckWrite(ReportLog& log, THREADID tid, const Access& a) {
+  VarCell& var = *a.var;
+  const VC<int>& c = thread_vc[tid];
+  const int e = c.Get(tid);
+
+  if (var.write_tid == tid && static_cast<int>(var.write_clock) == e) {
+    var.write_site = a.site;
+    return;
+  }
+
+  const bool shared = var.read_tid == VarCell::kSharedRead;
+  THREADID read_tid = var.read_tid;
+  int read_clock = var.read_clock;
+  const bool reads_covered =
+      shared ? !FindUncovered(shared_reads[var.read_clock], c,
+                              read_tid, read_clock)
+             : Covered(read_tid, read_clock, c);
+
+  if (!Covered(var.write_tid, var.write_clock, c)) {
+    ReportRace(log, tid, ReportKind::kWriteRace, a,
+               var.write_tid, var.write_clock, var.write_site);
+  } else if (!reads_covered) {
+    ReportRace(log, tid, ReportKind::kWriteRace, a,
+               read_tid, read_clock, var.read_site);
+  }
+
+  if (reads_covered) {
+    if (shared) {
+      shared_reads.Free(var.read_clock);
+    }
+    var.read_tid = 0;
+    var.read_clock = 0;
+  }
+  var.write_tid = tid;
+  var.write_clock = e;
+  var.write_site = a.site;
 }
 
-map<void*, THREADID> thread_to_id;
+/*!
+ * CheckRead checks a read against the last write of a granule, then
+ * adds it to the reads. The reads stay a single epoch while each one is
+ * ordered before the next, and become a vector clock in shared_reads
+ * once two of them are concurrent.
+ * @param[in]  log  the log of the accessing thread
+ * @param[in]  tid  id of the accessing thread
+ * @param[in]  a    the access
+ */
+void CheckRead(ReportLog& log, THREADID tid, const Access& a) {
+  VarCell& var = *a.var;
+  const VC<int>& c = thread_vc[tid];
+  const int e = c.Get(tid);
+  const bool shared = var.read_tid == VarCell::kSharedRead;
+
+  if (shared ? shared_reads[var.read_clock].Get(tid) == e
+             : var.read_tid == tid &&
+               static_cast<int>(var.read_clock) == e) {
+    var.read_site = a.site;
+    return;
+  }
+
+  if (!Covered(var.write_tid, var.write_clock, c)) {
+    ReportRace(log, tid, ReportKind::kReadRace, a,
+               var.write_tid, var.write_clock, var.write_site);
+  }
+
+  if (shared) {
+    shared_reads[var.read_clock][tid] = e;
+  } else if (Covered(var.read_tid, var.read_clock, c)) {
+    var.read_tid = tid;
+    var.read_clock = e;
+  } else {
+    const UINT32 slot = shared_reads.Alloc();
+    if (slot == SharedReads::kNoSlot) {
+      // Out of slots: the older read is dropped, which may miss a race
+      // with it but never reports a false one.
+      var.read_tid = tid;
+      var.read_clock = e;
+    } else {
+      VC<int>& reads = shared_reads[slot];
+      reads[var.read_tid] = var.read_clock;
+      reads[tid] = e;
+      var.read_tid = VarCell::kSharedRead;
+      var.read_clock = slot;
+    }
+  }
+  var.read_site = a.site;
+}
 
-void Fork(THREADID tid, void* thread_obj) {
-  static THREADID last_id = 0;
+/*!
+ * CheckAccess checks an access against the history of its granule and
+ * reports a race if it races with a previous one.
+ * LockFor(a.mem_addr) must be held.
+ * @param[in]  log  the log of the accessing thread
+ * @param[in]  tid  id of the accessing thread
+ * @param[in]  a    the access
+ */
+void CheckAccess(ReportLog& log, THREADID tid, const Access& a) {
+  if (a.is_write) {
+    CheckWrite(log, tid, a);
+  } else {
+    CheckRead(log, tid, a);
+  }
 
-  LockGuard l{vc_lock};
-  ++last_id;
-  thread_to_id[thread_obj] = last_id;
+  // The trace line goes to the thread's own log like race reports.
+  // Every access would be logged with -watch_all, so only races are.
+  if (!watch_all) {
+    AddReport(log, tid,
+              a.is_write ? ReportKind::kWrite : ReportKind::kRead, a);
+  }
+}
 
-  thread_vc[last_id] |= thread_vc[tid];
-  ++thread_vc[tid][tid];
+/*!
+ * FlushAccesses checks the accesses buffered by a thread in order.
+ * It must be called before the thread's vector clock changes, so that
+ * every access is checked with the clock at the time it happened.
+ * A stripe lock is held across consecutive accesses to the same stripe.
+ * The report log is drained after the locks are released.
+ * @param[in]  tid   id of the thread owning the buffer
+ * @param[in]  data  the thread's data, which Fini() passes explicitly
+ */
+void FlushAccesses(THREADID tid, ThreadData* data) {
+  AccessBuffer* buf = &data->accesses;
+  PIN_LOCK* held = nullptr;
+  for (size_t i = 0; i < buf->size; ++i) {
+    const Access& a = buf->accesses[i];
+    PIN_LOCK* l = &LockFor(a.mem_addr);
+    if (l != held) {
+      if (held) {
+        PIN_ReleaseLock(held);
+      }
+      PIN_GetLock(l, tid);
+      held = l;
+    }
+    CheckAccess(data->reports, tid, a);
+  }
+  if (held) {
+    PIN_ReleaseLock(held);
+  }
+  buf->size = 0;
+
+  if (data->reports.size >= ReportLog::kDrainSize) {
+    DrainReports(data->reports);
+  }
 }
 
-void Join(THREADID tid, void* thread_obj) {
-  LockGuard l{vc_lock};
-  const auto join_id = thread_to_id[thread_obj];
-  thread_vc[tid] |= thread_vc[join_id];
-  ++thread_vc[join_id][join_id];
+void FlushAccesses(THREADID tid) {
+  FlushAccesses(tid, DataOf(tid));
 }
 
 /*!
- * CheckOverflow detects out-of-bounds memory access.
- * An access is out-of-bounds if mem_addr doesn't match any of heap objects.
- * @param[in]  ins_addr  address of the memory-access instruction
- * @param[in]  mem_addr  effective address of the memory operand
- * @param[in]  is_write  true if the memory operand is written
+ * Aquire joins the clock of a synchronization object into the clock
+ * of thread tid. Every mutex, rwlock, spinlock and condition variable
+ * gets a clock in lock_vc when it is first released.
+ * @param[in]  tid        id of the acquiring thread
+ * @param[in]  lock_addr  address of the synchronization object
  */
-void CheckOverflow(ADDRINT ins_addr, ADDRINT mem_addr, BOOL is_write) {
-  if (read_vc.count(mem_addr) == 0) {
+void Aquire(THREADID tid, ADDRINT lock_addr) {
+  FlushAccesses(tid);
+  VC<int>** cell = lock_vc.Find(lock_addr);
+  if (cell == nullptr) {
     return;
   }
+  LockGuard l{LockFor(lock_addr)};
+  if (*cell != nullptr) {
+    thread_vc[tid] |= **cell;
+  }
+}
 
-  const auto tid = PIN_ThreadId();
-  PIN_GetLock(&lock, tid);
+/*!
+ * Release joins the clock of thread tid into the clock of a
+ * synchronization object and advances the thread's clock.
+ * The clocks are joined rather than copied because a rwlock may be
+ * released by several readers, and a condition variable signaled by
+ * several threads, before the next acquisition.
+ * @param[in]  tid        id of the releasing thread
+ * @param[in]  lock_addr  address of the synchronization object
+ */
+void PIN_FAST_ANALYSIS_CALL Release(THREADID tid, ADDRINT lock_addr) {
+  FlushAccesses(tid);
+  VC<int>** cell = lock_vc.FindOrAdd(lock_addr);
+  if (cell == nullptr) {
+    return;
+  }
+  {
+    LockGuard l{LockFor(lock_addr)};
+    if (*cell == nullptr) {
+      *cell = new VC<int>;
+    }
+    **cell |= thread_vc[tid];
+  }
+  ++thread_vc[tid][tid];
+}
 
-  //if (thread_vc[tid][tid] == 0) {
-  //  thread_vc[tid][tid] = 1;
-  //}
+// pending_forks holds the clocks of threads at pthread_create() by their
+// OS thread ids. A child takes the oldest one of its parent in
+// ThreadStart(), which may be older than its own if children of a
+// thread start out of order; that only adds false positives.
+map<OS_THREAD_ID, deque<VC<int>>> pending_forks;
+// exited_vc holds the clocks of exited threads by pthread_t,
+// joined in Join().
+map<ADDRINT, VC<int>> exited_vc;
+// pthread_of holds the pthread_t of each running thread.
+ADDRINT pthread_of[PIN_MAX_THREADS];
+
+void PIN_FAST_ANALYSIS_CALL Fork(THREADID tid) {
+  FlushAccesses(tid);
+  {
+    LockGuard l{thread_lock};
+    pending_forks[PIN_GetTid()].push_back(thread_vc[tid]);
+  }
+  ++thread_vc[tid][tid];
+}
 
-  if (is_write) {
-    Write(tid, mem_addr);
-    //write_vc[mem_addr][tid] = thread_vc[tid][tid];
-    if (!NoRaceForWrite(tid, mem_addr)) {
-      *out << "Write race: C[" << tid << "]=" << thread_vc[tid]
-           << ", R[" << mem_addr << "]=" << read_vc[mem_addr]
-           << ", W[" << mem_addr << "]=" << write_vc[mem_addr]
-           << endl;
-    }
-  } else {
-    Read(tid, mem_addr);
-    //read_vc[mem_addr][tid] = thread_vc[tid][tid];
-    if (!NoRaceForRead(tid, mem_addr)) {
-      *out << "Read race: C[" << tid << "]=" << thread_vc[tid]
-           << ", W[" << mem_addr << "]=" << write_vc[mem_addr]
-           << endl;
-    }
+void Join(THREADID tid, ADDRINT thread) {
+  FlushAccesses(tid);
+  LockGuard l{thread_lock};
+  auto it = exited_vc.find(thread);
+  if (it != exited_vc.end()) {
+    thread_vc[tid] |= it->second;
+    exited_vc.erase(it);
   }
+}
 
-  const char* type = is_write ? "write" : "read";
-  *out << hex << "Found " << type << " variable 'x'"
-       << " by thread " << PIN_ThreadId()
-       << " at 0x" << mem_addr << " (IP=0x" << ins_addr << ")" << endl;
-  PIN_ReleaseLock(&lock);
+/*!
+ * PushSyncArg saves an argument of a pthread function at its entry
+ * for the analysis routine called when it returns.
+ * @param[in]  tid  id of the calling thread
+ * @param[in]  arg  the argument
+ */
+void PIN_FAST_ANALYSIS_CALL PushSyncArg(THREADID tid, ADDRINT arg) {
+  ThreadData* data = DataOf(tid);
+  if (data->num_sync_args < ThreadData::kMaxSyncArgs) {
+    data->sync_args[data->num_sync_args] = arg;
+  }
+  ++data->num_sync_args;
 }
 
-bool main_started = false;
+ADDRINT PopSyncArg(THREADID tid) {
+  ThreadData* data = DataOf(tid);
+  const size_t i = --data->num_sync_args;
+  return i < ThreadData::kMaxSyncArgs ? data->sync_args[i] : 0;
+}
 
-void OnMainStarted() {
-  main_started = true;
+/*!
+ * AfterLock is called when a locking function returns.
+ * The lock is acquired only if it succeeded.
+ * @param[in]  tid  id of the calling thread
+ * @param[in]  ret  return value of the locking function
+ */
+void PIN_FAST_ANALYSIS_CALL AfterLock(THREADID tid, ADDRINT ret) {
+  const ADDRINT lock_addr = PopSyncArg(tid);
+  if (static_cast<int>(ret) == 0 && lock_addr != 0) {
+    Aquire(tid, lock_addr);
+  }
 }
 
 /*!
- * MutexLockWrapper calls mutex.lock() and process vector clocks.
- * @param[in]  ctx  
+ * BeforeCondWait releases the mutex given to pthread_cond_wait().
+ * @param[in]  tid   id of the calling thread
+ * @param[in]  cond  the condition variable
+ * @param[in]  m     the mutex
  */
-void MutexLockWrapper(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* m) {
-  const auto tid = PIN_ThreadId();
+void PIN_FAST_ANALYSIS_CALL BeforeCondWait(
+    THREADID tid, ADDRINT cond, ADDRINT m) {
+  PushSyncArg(tid, cond);
+  PushSyncArg(tid, m);
+  Release(tid, m);
+}
 
-  PIN_CallApplicationFunction(ctx, tid, CALLINGSTD_DEFAULT,
-                              orig_func_ptr, nullptr,
-                              PIN_PARG(void),
-                              PIN_PARG(void*), m,
-                              PIN_PARG_END());
-  // PIN_PARG(void) must appear first in the argument list
-  // when the function has no return value.
+/*!
+ * AfterCondWait reacquires the mutex, and the condition variable
+ * if the wait didn't time out.
+ * @param[in]  tid  id of the calling thread
+ * @param[in]  ret  return value of pthread_cond_wait()
+ */
+void PIN_FAST_ANALYSIS_CALL AfterCondWait(THREADID tid, ADDRINT ret) {
+  const ADDRINT m = PopSyncArg(tid);
+  const ADDRINT cond = PopSyncArg(tid);
+  if (m != 0) {
+    Aquire(tid, m);
+  }
+  if (static_cast<int>(ret) == 0 && cond != 0) {
+    Aquire(tid, cond);
+  }
+}
 
-  const ADDRINT mtx_addr = reinterpret_cast<ADDRINT>(m);
-  if (lock_vc.count(mtx_addr)) {
-    Aquire(tid, mtx_addr);
+void PIN_FAST_ANALYSIS_CALL AfterJoin(THREADID tid, ADDRINT ret) {
+  const ADDRINT thread = PopSyncArg(tid);
+  if (static_cast<int>(ret) == 0) {
+    Join(tid, thread);
   }
 }
 
 /*!
- * MutexUnlockWrapper calls mutex.unlock() and process vector clocks.
- * @param[in]  ctx  
+ * MayBeWatched is the inlined fast path filter of RecordAccess().
+ * It returns zero unless mem_addr is near a watched variable.
+ * @param[in]  mem_addr  effective address of the memory operand
  */
-void MutexUnlockWrapper(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* m) {
-  const auto tid = PIN_ThreadId();
+ADDRINT PIN_FAST_ANALYSIS_CALL MayBeWatched(ADDRINT mem_addr) {
+  return watch_all | var_vc.MayContain(mem_addr);
+}
 
-  const ADDRINT mtx_addr = reinterpret_cast<ADDRINT>(m);
-  if (lock_vc.count(mtx_addr)) {
-    Release(tid, mtx_addr);
+/*!
+ * RecordAccess appends an access to a watched variable to the buffer of
+ * the accessing thread. The buffer is checked when it fills up or the
+ * thread reaches a synchronization point.
+ * It is called only if MayBeWatched() returns non-zero.
+ * @param[in]  tid       id of the accessing thread
+ * @param[in]  site      site id of the memory-access instruction
+ * @param[in]  mem_addr  effective address of the memory operand
+ * @param[in]  is_write  true if the memory operand is written
+ */
+void PIN_FAST_ANALYSIS_CALL RecordAccess(
+    THREADID tid, UINT32 site, ADDRINT mem_addr, BOOL is_write) {
+  VarCell* var = watch_all ? var_vc.FindOrAdd(mem_addr)
+                           : var_vc.Find(mem_addr);
+  if (var == nullptr || !(watch_all || var->watched)) {
+    return;
   }
 
-  PIN_CallApplicationFunction(ctx, tid, CALLINGSTD_DEFAULT,
-                              orig_func_ptr, nullptr,
-                              PIN_PARG(void),
-                              PIN_PARG(void*), m,
-                              PIN_PARG_END());
+  AccessBuffer* buf = &DataOf(tid)->accesses;
+  buf->accesses[buf->size++] = Access{site, is_write, mem_addr, var};
+  if (buf->size == AccessBuffer::kCapacity) {
+    FlushAccesses(tid);
+  }
 }
 
-void ThreadCtorWrapper(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* t) {
-  const auto tid = PIN_ThreadId();
+/*!
+ * HeapBlocks holds the size of each live heap block by its address, so
+ * that free() knows the range whose history is to be forgotten. The
+ * table is split into shards with their own locks.
+ */
+class HeapBlocks {
+ public:
+  HeapBlocks() {
+    for (auto& s : shards_) {
+      PIN_InitLock(&s.lock);
+    }
+  }
+
+  void Add(ADDRINT addr, size_t size) {
+    Shard& s = ShardOf(addr);
+    LockGuard l{s.lock};
+    s.sizes[addr] = size;
+  }
+
+  // Remove forgets the block at addr and returns its size,
+  // or 0 if it isn't known.
+  size_t Remove(ADDRINT addr) {
+    Shard& s = ShardOf(addr);
+    LockGuard l{s.lock};
+    auto it = s.sizes.find(addr);
+    if (it == s.sizes.end()) {
+      return 0;
+    }
+    const size_t size = it->second;
+    s.sizes.erase(it);
+    return size;
+  }
+
+ private:
+  static constexpr size_t kNumShards = 64;
+
+  struct alignas(64) Shard {
+    PIN_LOCK lock;
+    unordered_map<ADDRINT, size_t> sizes;
+  };
+
+  Shard& ShardOf(ADDRINT addr) {
+    return shards_[(addr >> 4) % kNumShards];
+  }
+
+  Shard shards_[kNumShards];
+};
+
+HeapBlocks heap_blocks;
+
+/*!
+ * ForgetRange clears the history of the granules in freed memory, so
+ * that accesses to an object allocated later at the same address are
+ * not reported as racing with accesses to the freed one.
+ * The accesses buffered by the freeing thread are checked first. After
+ * that, a cell in the range is only written by an access racing with
+ * the free, so empty cells, which most are, are skipped without taking
+ * a lock. The shadow pages inside the range are then returned to the OS.
+ * @param[in]  tid   id of the freeing thread
+ * @param[in]  addr  first address of the freed memory
+ * @param[in]  size  number of bytes freed
+ */
+void ForgetRange(THREADID tid, ADDRINT addr, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  FlushAccesses(tid);
+
+  var_vc.ForEachInRange(addr, size, [](ADDRINT g, VarCell& c) {
+    if (c.Empty()) {
+      return;
+    }
+    LockGuard l{LockFor(g)};
+    if (c.read_tid == VarCell::kSharedRead) {
+      shared_reads.Free(c.read_clock);
+    }
+    const bool watched = c.watched;
+    c = VarCell{};
+    c.watched = watched;
+  });
+  var_vc.Discard(addr, size);
+}
 
-  cout << "thread ctor by thread " << tid << endl;
+/*!
+ * BeforeAlloc saves the size given to an allocating function.
+ * @param[in]  tid   id of the calling thread
+ * @param[in]  n     number of elements, 1 except for calloc()
+ * @param[in]  size  size of an element
+ */
+void PIN_FAST_ANALYSIS_CALL BeforeAlloc(
+    THREADID tid, ADDRINT n, ADDRINT size) {
+  PushSyncArg(tid, n * size);
+}
 
-  Fork(tid, t);
+void PIN_FAST_ANALYSIS_CALL AfterAlloc(THREADID tid, ADDRINT ret) {
+  const ADDRINT size = PopSyncArg(tid);
+  if (ret != 0) {
+    heap_blocks.Add(ret, size);
+  }
+}
 
-  PIN_CallApplicationFunction(ctx, tid, CALLINGSTD_DEFAULT,
-                              orig_func_ptr, nullptr,
-                              PIN_PARG(void),
-                              PIN_PARG(void*), t,
-                              PIN_PARG_END());
+void PIN_FAST_ANALYSIS_CALL BeforeFree(THREADID tid, ADDRINT ptr) {
+  if (ptr == 0) {
+    return;
+  }
+  const size_t size = heap_blocks.Remove(ptr);
+  ForgetRange(tid, ptr, size);
+  ThreadData* data = DataOf(tid);
+  data->freed_begin = ptr;
+  data->freed_end = ptr + size;
 }
 
-void ThreadJoinWrapper(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* t) {
-  const auto tid = PIN_ThreadId();
+/*!
+ * BeforeRealloc treats the old block as freed. If realloc() fails the
+ * block stays valid but its history is lost, which only misses races.
+ * @param[in]  tid   id of the calling thread
+ * @param[in]  ptr   the old block
+ * @param[in]  size  the new size
+ */
+void PIN_FAST_ANALYSIS_CALL BeforeRealloc(
+    THREADID tid, ADDRINT ptr, ADDRINT size) {
+  BeforeFree(tid, ptr);
+  PushSyncArg(tid, size);
+}
 
-  PIN_CallApplicationFunction(ctx, tid, CALLINGSTD_DEFAULT,
-                              orig_func_ptr, nullptr,
-                              PIN_PARG(void),
-                              PIN_PARG(void*), t,
-                              PIN_PARG_END());
+/*!
+ * BeforeMunmap forgets the unmapped range. free() of a large block
+ * unmaps it with its header, so only the part of the range around the
+ * block just forgotten by BeforeFree() is left to forget.
+ * @param[in]  tid   id of the calling thread
+ * @param[in]  addr  first address of the range
+ * @param[in]  len   number of bytes in the range
+ */
+void PIN_FAST_ANALYSIS_CALL BeforeMunmap(
+    THREADID tid, ADDRINT addr, ADDRINT len) {
+  ThreadData* data = DataOf(tid);
+  const ADDRINT end = addr + len;
+  if (addr <= data->freed_begin && data->freed_begin < data->freed_end &&
+      data->freed_end <= end) {
+    ForgetRange(tid, addr, data->freed_begin - addr);
+    ForgetRange(tid, data->freed_end, end - data->freed_end);
+  } else {
+    ForgetRange(tid, addr, len);
+  }
+  data->freed_begin = 0;
+  data->freed_end = 0;
+}
 
-  cout << "thread::join by thread " << tid << endl;
+bool main_started = false;
 
-  Join(tid, t);
+void OnMainStarted() {
+  main_started = true;
 }
 
 /* ===================================================================== */
@@ -386,8 +1172,9 @@ void ThreadJoinWrapper(CONTEXT* ctx, AFUNPTR orig_func_ptr, void* t) {
 UINT32 main_rtn_id;
 
 /*!
- * ObserveMemAccess inserts call to the CheckOverflow() analysis routine
+ * ObserveMemAccess inserts call to the RecordAccess() analysis routine
  * before every memory-accessing instructions inside main().
+ * The call is guarded by MayBeWatched(), which Pin can inline.
  * @param[in]  trace  trace to be instrumented
  */
 VOID ObserveMemAccess(TRACE trace, VOID*) {
@@ -398,8 +1185,9 @@ VOID ObserveMemAccess(TRACE trace, VOID*) {
 
   for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
     for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+      // Accesses relative to RIP are kept since they reach globals.
       REG base_reg = INS_MemoryBaseReg(ins);
-      if (base_reg == REG_RSP || base_reg == REG_RBP || base_reg == REG_RIP) {
+      if (base_reg == REG_RSP || base_reg == REG_RBP) {
         continue;
       }
 
@@ -409,9 +1197,16 @@ VOID ObserveMemAccess(TRACE trace, VOID*) {
           continue;
         }
 
-        INS_InsertCall(
-            ins, IPOINT_BEFORE, reinterpret_cast<AFUNPTR>(CheckOverflow),
-            IARG_INST_PTR,
+        INS_InsertIfCall(
+            ins, IPOINT_BEFORE, reinterpret_cast<AFUNPTR>(MayBeWatched),
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_MEMORYOP_EA, memop,
+            IARG_END);
+        INS_InsertThenCall(
+            ins, IPOINT_BEFORE, reinterpret_cast<AFUNPTR>(RecordAccess),
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_THREAD_ID,
+            IARG_UINT32, sites.Add(INS_Address(ins)),
             IARG_MEMORYOP_EA, memop,
             IARG_BOOL, INS_MemoryOperandIsWritten(ins, memop),
             IARG_END);
@@ -420,57 +1215,217 @@ VOID ObserveMemAccess(TRACE trace, VOID*) {
   }
 }
 
+// Functions acquiring the lock given as the 1st argument on success.
+const char* const kLockFuncs[] = {
+  "pthread_mutex_lock", "pthread_mutex_trylock", "pthread_mutex_timedlock",
+  "pthread_rwlock_rdlock", "pthread_rwlock_tryrdlock",
+  "pthread_rwlock_timedrdlock",
+  "pthread_rwlock_wrlock", "pthread_rwlock_trywrlock",
+  "pthread_rwlock_timedwrlock",
+  "pthread_spin_lock", "pthread_spin_trylock",
+};
+
+// Functions releasing the object given as the 1st argument.
+const char* const kUnlockFuncs[] = {
+  "pthread_mutex_unlock", "pthread_rwlock_unlock", "pthread_spin_unlock",
+  "pthread_cond_signal", "pthread_cond_broadcast",
+};
+
+const char* const kCondWaitFuncs[] = {
+  "pthread_cond_wait", "pthread_cond_timedwait",
+};
+
 /*!
- * ReplaceLock replaces lock()/unlock() of std::mutex with wrapper functions.
+ * InstrumentPthread inserts analysis calls before and after the pthread
+ * functions for locks, condition variables and threads.
+ * The calls use the fast calling convention and never allocate
+ * in the common case.
  * @param[in]  img  image to be instrumented
  */
-VOID ReplaceLock(IMG img, VOID*) {
-  RTN lock_rtn = RTN_FindByName(img, "_ZNSt5mutex4lockEv");
-  RTN unlock_rtn = RTN_FindByName(img, "_ZNSt5mutex6unlockEv");
+VOID InstrumentPthread(IMG img, VOID*) {
+  for (const char* name : kLockFuncs) {
+    RTN rtn = RTN_FindByName(img, name);
+    if (!RTN_Valid(rtn)) {
+      continue;
+    }
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(PushSyncArg),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_END);
+    RTN_InsertCall(rtn, IPOINT_AFTER,
+        reinterpret_cast<AFUNPTR>(AfterLock),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCRET_EXITPOINT_VALUE,
+        IARG_END);
+    RTN_Close(rtn);
+  }
 
-  if (RTN_Valid(lock_rtn)) {
-    cout << "found std::mutex::lock" << endl;
-    RTN_ReplaceSignature(
-        lock_rtn, reinterpret_cast<AFUNPTR>(MutexLockWrapper),
-        IARG_CONTEXT,
-        IARG_ORIG_FUNCPTR,
+  for (const char* name : kUnlockFuncs) {
+    RTN rtn = RTN_FindByName(img, name);
+    if (!RTN_Valid(rtn)) {
+      continue;
+    }
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(Release),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
         IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
         IARG_END);
+    RTN_Close(rtn);
+  }
+
+  for (const char* name : kCondWaitFuncs) {
+    RTN rtn = RTN_FindByName(img, name);
+    if (!RTN_Valid(rtn)) {
+      continue;
+    }
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(BeforeCondWait),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+        IARG_END);
+    RTN_InsertCall(rtn, IPOINT_AFTER,
+        reinterpret_cast<AFUNPTR>(AfterCondWait),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCRET_EXITPOINT_VALUE,
+        IARG_END);
+    RTN_Close(rtn);
+  }
+
+  RTN create_rtn = RTN_FindByName(img, "pthread_create");
+  if (RTN_Valid(create_rtn)) {
+    RTN_Open(create_rtn);
+    RTN_InsertCall(create_rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(Fork),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_END);
+    RTN_Close(create_rtn);
   }
 
-  if (RTN_Valid(unlock_rtn)) {
-    cout << "found std::mutex::unlock" << endl;
-    RTN_ReplaceSignature(
-        unlock_rtn, reinterpret_cast<AFUNPTR>(MutexUnlockWrapper),
-        IARG_CONTEXT,
-        IARG_ORIG_FUNCPTR,
+  RTN join_rtn = RTN_FindByName(img, "pthread_join");
+  if (RTN_Valid(join_rtn)) {
+    RTN_Open(join_rtn);
+    RTN_InsertCall(join_rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(PushSyncArg),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
         IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
         IARG_END);
+    RTN_InsertCall(join_rtn, IPOINT_AFTER,
+        reinterpret_cast<AFUNPTR>(AfterJoin),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCRET_EXITPOINT_VALUE,
+        IARG_END);
+    RTN_Close(join_rtn);
   }
 }
 
-VOID ReplaceThread(IMG img, VOID*) {
-  RTN ctor_rtn = RTN_FindByName(img, "_ZNSt6threadC1IRFvvEJEvEEOT_DpOT0_");
-  RTN join_rtn = RTN_FindByName(img, "_ZNSt6thread4joinEv");
+// Functions allocating a heap block and the indices of the arguments
+// whose product is its size. An index of -1 stands for 1.
+struct AllocFunc {
+  const char* name;
+  int n_arg;
+  int size_arg;
+};
+
+const AllocFunc kAllocFuncs[] = {
+  {"malloc", -1, 0}, {"calloc", 0, 1},
+  {"memalign", -1, 1}, {"aligned_alloc", -1, 1}, {"valloc", -1, 0},
+};
 
-  if (RTN_Valid(ctor_rtn)) {
-    cout << "found std::thread::thread" << endl;
-    RTN_ReplaceSignature(
-        ctor_rtn, reinterpret_cast<AFUNPTR>(ThreadCtorWrapper),
-        IARG_CONTEXT,
-        IARG_ORIG_FUNCPTR,
+/*!
+ * InstrumentHeap inserts analysis calls around the heap functions and
+ * before munmap(), so that freed memory forgets its history.
+ * It is only used with -watch_all, since variables watched by name
+ * are never freed.
+ * @param[in]  img  image to be instrumented
+ */
+VOID InstrumentHeap(IMG img, VOID*) {
+  for (const AllocFunc& f : kAllocFuncs) {
+    RTN rtn = RTN_FindByName(img, f.name);
+    if (!RTN_Valid(rtn)) {
+      continue;
+    }
+    RTN_Open(rtn);
+    if (f.n_arg < 0) {
+      RTN_InsertCall(rtn, IPOINT_BEFORE,
+          reinterpret_cast<AFUNPTR>(BeforeAlloc),
+          IARG_FAST_ANALYSIS_CALL,
+          IARG_THREAD_ID,
+          IARG_ADDRINT, ADDRINT{1},
+          IARG_FUNCARG_ENTRYPOINT_VALUE, f.size_arg,
+          IARG_END);
+    } else {
+      RTN_InsertCall(rtn, IPOINT_BEFORE,
+          reinterpret_cast<AFUNPTR>(BeforeAlloc),
+          IARG_FAST_ANALYSIS_CALL,
+          IARG_THREAD_ID,
+          IARG_FUNCARG_ENTRYPOINT_VALUE, f.n_arg,
+          IARG_FUNCARG_ENTRYPOINT_VALUE, f.size_arg,
+          IARG_END);
+    }
+    RTN_InsertCall(rtn, IPOINT_AFTER,
+        reinterpret_cast<AFUNPTR>(AfterAlloc),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCRET_EXITPOINT_VALUE,
+        IARG_END);
+    RTN_Close(rtn);
+  }
+
+  RTN realloc_rtn = RTN_FindByName(img, "realloc");
+  if (RTN_Valid(realloc_rtn)) {
+    RTN_Open(realloc_rtn);
+    RTN_InsertCall(realloc_rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(BeforeRealloc),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
         IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
         IARG_END);
+    RTN_InsertCall(realloc_rtn, IPOINT_AFTER,
+        reinterpret_cast<AFUNPTR>(AfterAlloc),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCRET_EXITPOINT_VALUE,
+        IARG_END);
+    RTN_Close(realloc_rtn);
   }
 
-  if (RTN_Valid(join_rtn)) {
-    cout << "found std::thread::join" << endl;
-    RTN_ReplaceSignature(
-        join_rtn, reinterpret_cast<AFUNPTR>(ThreadJoinWrapper),
-        IARG_CONTEXT,
-        IARG_ORIG_FUNCPTR,
+  RTN free_rtn = RTN_FindByName(img, "free");
+  if (RTN_Valid(free_rtn)) {
+    RTN_Open(free_rtn);
+    RTN_InsertCall(free_rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(BeforeFree),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
         IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
         IARG_END);
+    RTN_Close(free_rtn);
+  }
+
+  RTN munmap_rtn = RTN_FindByName(img, "munmap");
+  if (RTN_Valid(munmap_rtn)) {
+    RTN_Open(munmap_rtn);
+    RTN_InsertCall(munmap_rtn, IPOINT_BEFORE,
+        reinterpret_cast<AFUNPTR>(BeforeMunmap),
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_THREAD_ID,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+        IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+        IARG_END);
+    RTN_Close(munmap_rtn);
   }
 }
 
@@ -490,6 +1445,56 @@ VOID InsertMainMarker(IMG img, VOID*) {
   }
 }
 
+/*!
+ * ThreadStart allocates the ThreadData of a new thread and joins the
+ * clock its parent had at pthread_create().
+ * On x86-64 Linux, pthread_self() is the base address of FS.
+ */
+VOID ThreadStart(THREADID tid, CONTEXT* ctx, INT32, VOID*) {
+  ThreadData* data = new ThreadData;
+  PIN_SetThreadData(thread_data_key, data, tid);
+  pthread_of[tid] = PIN_GetContextReg(ctx, REG_SEG_FS_BASE);
+
+  LockGuard l{thread_lock};
+  live_threads[tid] = data;
+  auto it = pending_forks.find(PIN_GetParentTid());
+  if (it != pending_forks.end()) {
+    thread_vc[tid] |= it->second.front();
+    it->second.pop_front();
+    if (it->second.empty()) {
+      pending_forks.erase(it);
+    }
+  }
+}
+
+/*!
+ * ThreadFini checks the accesses left in the buffer of an exiting thread
+ * and writes its remaining reports. The final clock of the thread is
+ * kept for pthread_join() and its slot is cleared for reuse.
+ */
+VOID ThreadFini(THREADID tid, const CONTEXT*, INT32, VOID*) {
+  FlushAccesses(tid);
+  DrainReports(DataOf(tid)->reports);
+
+  LockGuard l{thread_lock};
+  delete DataOf(tid);
+  PIN_SetThreadData(thread_data_key, nullptr, tid);
+  live_threads[tid] = nullptr;
+  exited_vc[pthread_of[tid]] = thread_vc[tid];
+  thread_vc.Reset(tid);
+}
+
+/*!
+ * ReadClock returns the reads of a granule as a vector clock.
+ * @param[in]  c  the cell of the granule
+ */
+VC<int> ReadClock(const VarCell& c) {
+  if (c.read_tid == VarCell::kSharedRead) {
+    return shared_reads[c.read_clock];
+  }
+  return VC<int>{c.read_tid, static_cast<int>(c.read_clock)};
+}
+
 /*!
  * Print out analysis results.
  * This function is called when the application exits.
@@ -498,30 +1503,38 @@ VOID InsertMainMarker(IMG img, VOID*) {
  *                              PIN_AddFiniFunction function call
  */
 VOID Fini(INT32 code, VOID* v) {
+  // Threads still alive at exit don't run ThreadFini(), so what they
+  // have buffered is checked and written here. They no longer run.
+  for (THREADID tid = 0; tid < PIN_MAX_THREADS; ++tid) {
+    if (ThreadData* data = live_threads[tid]) {
+      FlushAccesses(tid, data);
+      DrainReports(data->reports);
+    }
+  }
+
   PIN_GetLock(&lock, PIN_ThreadId());
 
   *out << "===============================================" << endl;
-  vector<THREADID> tids;
-  for (const auto& [tid, vc] : thread_vc) {
-    tids.push_back(tid);
-  }
-  for (THREADID tid : tids) {
+  for (THREADID tid = 0; tid < PIN_MAX_THREADS; ++tid) {
+    if (!thread_vc.Started(tid)) {
+      continue;
+    }
     *out << "Thread " << tid << "'s VC: " << thread_vc[tid];
   }
 
-  vector<ADDRINT> locs;
-  for (const auto& [loc, vc] : read_vc) {
-    locs.push_back(loc);
-  }
-  for (ADDRINT loc : locs) {
+  for (ADDRINT loc : watched_addrs) {
     *out << "Read VC for location " << hex << loc
-         << ": " << read_vc[loc] << endl;
+         << ": " << ReadClock(*var_vc.Find(loc)) << endl;
   }
-  for (ADDRINT loc : locs) {
+  for (ADDRINT loc : watched_addrs) {
+    const VarCell& c = *var_vc.Find(loc);
     *out << "Write VC for location " << hex << loc
-         << ": <" << write_vc[loc] << endl;
+         << ": " << VC<int>{c.write_tid, static_cast<int>(c.write_clock)}
+         << endl;
   }
   *out << "===============================================" << endl;
+  race_sites.Print(*out);
+  *out << "===============================================" << endl;
 
   PIN_ReleaseLock(&lock);
 }
@@ -540,23 +1553,58 @@ int main(int argc, char** argv) {
     return Usage();
   }
 
-  set<string> watch_vars, watch_locks;
-  watch_vars.insert("x");
-  watch_locks.insert("m");
+  int granule_shift;
+  switch (KnobGranularity.Value()) {
+  case 1: granule_shift = 0; break;
+  case 4: granule_shift = 2; break;
+  case 8: granule_shift = 3; break;
+  default: return Usage();
+  }
+
+  if (var_vc.Init(granule_shift) || lock_vc.Init(0) || sites.Init()) {
+    cerr << "Failed to reserve shadow memory" << endl;
+    return 1;
+  }
+
+  set<string> watch_vars;
+  for (UINT32 i = 0; i < KnobWatchVars.NumberOfValues(); ++i) {
+    watch_vars.insert(KnobWatchVars.Value(i));
+  }
+
+  vector<string> watch_patterns;
+  for (UINT32 i = 0; i < KnobWatchPattern.NumberOfValues(); ++i) {
+    if (!KnobWatchPattern.Value(i).empty()) {
+      watch_patterns.push_back(KnobWatchPattern.Value(i));
+    }
+  }
+  watch_all = KnobWatchAll.Value();
 
   if (LoadSymbolAddrFromTargetBinary(
-      argc, argv, watch_vars, watch_locks)) {
+      argc, argv, watch_vars, watch_patterns)) {
     return Usage();
   }
 
   if (!KnobOutputFile.Value().empty()) {
-    out = new std::ofstream(KnobOutputFile.Value().c_str());
+    auto f = new std::ofstream;
+    f->rdbuf()->pubsetbuf(out_buf, sizeof(out_buf));
+    f->open(KnobOutputFile.Value().c_str());
+    out = f;
+  }
+
+  thread_data_key = PIN_CreateThreadDataKey(nullptr);
+  if (thread_data_key == INVALID_TLS_KEY) {
+    cerr << "Failed to create a TLS key" << endl;
+    return 1;
   }
 
-  IMG_AddInstrumentFunction(ReplaceLock, 0);
+  IMG_AddInstrumentFunction(InstrumentPthread, 0);
+  if (watch_all) {
+    IMG_AddInstrumentFunction(InstrumentHeap, 0);
+  }
   IMG_AddInstrumentFunction(InsertMainMarker, 0);
-  IMG_AddInstrumentFunction(ReplaceThread, 0);
   TRACE_AddInstrumentFunction(ObserveMemAccess, 0);
+  PIN_AddThreadStartFunction(ThreadStart, 0);
+  PIN_AddThreadFiniFunction(ThreadFini, 0);
   PIN_AddFiniFunction(Fini, 0);
 
   cerr << "===============================================" << endl;
@@ -568,7 +1616,10 @@ int main(int argc, char** argv) {
   cerr << "===============================================" << endl;
 
   PIN_InitLock(&lock);
-  PIN_InitLock(&vc_lock);
+  PIN_InitLock(&thread_lock);
+  for (auto& s : stripe_locks) {
+    PIN_InitLock(&s.l);
+  }
 
   // Start the program, never returns
   PIN_StartProgram();